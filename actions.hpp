@@ -1,7 +1,15 @@
 #include <iostream>
 #include <vector>
+#include <array>
 #include <string>
+#include <string_view>
 #include <sstream>
+#include <unordered_map>
+#include <list>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <algorithm>
 #include <stdio.h>
 #include <cmath>
 
@@ -9,6 +17,8 @@
 #include "json.hpp"
 #include "common.h"
 #include "sampling.h"
+#include "vector_index.hpp"
+#include "lz_codec.hpp"
 
 /**
  * CCAMA project - A low-level llama.cpp API via JSON
@@ -24,6 +34,9 @@ using json = nlohmann::json;
     send_response(json{{"debug" : std::string(output)}}); \
   }
 
+// extra token attribute, not part of llama_token_attr
+#define WLLAMA_TOKEN_ATTR_EOG (1 << 16)
+
 #define ACTION(name)          \
   if (action == #name)        \
   {                           \
@@ -31,22 +44,639 @@ using json = nlohmann::json;
     continue;                 \
   }
 
+// Aho-Corasick automaton to find stop strings in the output bytes, including the ones spanning over multiple tokens
+struct stop_string_matcher
+{
+  std::vector<std::array<int32_t, 256>> next; // goto function, completed with failure transitions
+  std::vector<int32_t> match_len;             // length of the longest stop string ending at this node, 0 if none
+  std::vector<int32_t> depth;
+  int32_t state = 0;
+  std::string pending; // held back output, may be the beginning of a stop string
+
+  void init(const std::vector<std::string> &stop_strings)
+  {
+    next.clear();
+    match_len.clear();
+    depth.clear();
+    add_node(0);
+    state = 0;
+    pending.clear();
+    // build trie
+    for (auto &str : stop_strings)
+    {
+      if (str.empty())
+        continue;
+      int32_t node = 0;
+      for (unsigned char c : str)
+      {
+        if (next[node][c] < 0)
+        {
+          next[node][c] = add_node(depth[node] + 1);
+        }
+        node = next[node][c];
+      }
+      match_len[node] = str.size();
+    }
+    // compute failure links (BFS), then fill the missing transitions
+    std::vector<int32_t> fail(next.size(), 0);
+    std::vector<int32_t> queue;
+    for (int c = 0; c < 256; c++)
+    {
+      int32_t v = next[0][c];
+      if (v < 0)
+      {
+        next[0][c] = 0;
+      }
+      else
+      {
+        queue.push_back(v);
+      }
+    }
+    for (size_t i = 0; i < queue.size(); i++)
+    {
+      int32_t u = queue[i];
+      if (match_len[u] == 0)
+        match_len[u] = match_len[fail[u]];
+      for (int c = 0; c < 256; c++)
+      {
+        int32_t v = next[u][c];
+        if (v < 0)
+        {
+          next[u][c] = next[fail[u]][c];
+        }
+        else
+        {
+          fail[v] = next[fail[u]][c];
+          queue.push_back(v);
+        }
+      }
+    }
+  }
+
+  bool empty() const
+  {
+    return next.size() <= 1;
+  }
+
+  // feed the piece of a new token, returns true if a stop string is found
+  // output is set to the bytes that can be safely emitted (before the stop string, if any)
+  bool feed(std::string_view piece, std::string &output)
+  {
+    size_t start = pending.size();
+    pending += piece;
+    for (size_t i = start; i < pending.size(); i++)
+    {
+      state = next[state][(unsigned char)pending[i]];
+      if (match_len[state] > 0)
+      {
+        output = pending.substr(0, i + 1 - match_len[state]);
+        pending.clear();
+        state = 0;
+        return true;
+      }
+    }
+    // the current state is the longest suffix that is also a prefix of a stop string, hold it back
+    size_t n_emit = pending.size() - depth[state];
+    output = pending.substr(0, n_emit);
+    pending.erase(0, n_emit);
+    return false;
+  }
+
+private:
+  int32_t add_node(int32_t d)
+  {
+    next.emplace_back();
+    next.back().fill(-1);
+    match_len.push_back(0);
+    depth.push_back(d);
+    return next.size() - 1;
+  }
+};
+
+// incremental detokenizer, only emits complete UTF-8 sequences
+// bytes of an unfinished sequence are held back until the next pieces arrive
+struct stream_detokenizer
+{
+  std::string pending;
+  bool at_start = true;          // no token was fed since the last reset
+  bool strip_next_space = false; // set after BOS, if the vocab adds a space prefix
+
+  void reset()
+  {
+    pending.clear();
+    at_start = true;
+    strip_next_space = false;
+  }
+
+  // append the piece, returns the part that is valid UTF-8 (invalid bytes are replaced by U+FFFD)
+  // validation follows RFC 3629: no overlong forms, surrogates or code points above U+10FFFF
+  std::string feed(std::string_view piece)
+  {
+    pending += piece;
+    std::string output;
+    output.reserve(pending.size());
+    size_t i = 0;
+    while (i < pending.size())
+    {
+      unsigned char c = pending[i];
+      size_t len = c < 0x80                 ? 1
+                   : c >= 0xC2 && c <= 0xDF ? 2
+                   : c >= 0xE0 && c <= 0xEF ? 3
+                   : c >= 0xF0 && c <= 0xF4 ? 4
+                                            : 0;
+      if (len == 0)
+      {
+        output += "\xEF\xBF\xBD"; // invalid lead byte
+        i++;
+        continue;
+      }
+      // the range of the second byte depends on the lead byte
+      unsigned char lo = c == 0xE0 ? 0xA0 : c == 0xF0 ? 0x90 : 0x80;
+      unsigned char hi = c == 0xED ? 0x9F : c == 0xF4 ? 0x8F : 0xBF;
+      size_t n_cont = 1;
+      while (n_cont < len && i + n_cont < pending.size())
+      {
+        unsigned char cc = pending[i + n_cont];
+        if (n_cont == 1 ? (cc < lo || cc > hi) : (cc >> 6) != 0x2)
+        {
+          break;
+        }
+        n_cont++;
+      }
+      if (n_cont == len)
+      {
+        output.append(pending, i, len);
+        i += len;
+      }
+      else if (i + n_cont == pending.size())
+      {
+        break; // unfinished sequence, wait for more bytes
+      }
+      else
+      {
+        output += "\xEF\xBF\xBD"; // truncated or invalid sequence
+        i += n_cont;
+      }
+    }
+    pending.erase(0, i);
+    return output;
+  }
+};
+
+// 64-bit FNV-1a hash
+static uint64_t fnv1a_64(const void *data, size_t size, uint64_t h = 0xcbf29ce484222325ULL)
+{
+  const uint8_t *p = (const uint8_t *)data;
+  for (size_t i = 0; i < size; i++)
+  {
+    h ^= p[i];
+    h *= 0x100000001b3ULL;
+  }
+  return h;
+}
+
+// LRU cache of raw (not yet normalized) embeddings, keyed by the input tokens and the pooling type
+// it is bounded by max_bytes (0 means disabled) and cleared when the model is unloaded
+struct embd_cache_t
+{
+  struct entry_t
+  {
+    uint64_t key;
+    int32_t pooling;
+    std::vector<llama_token> tokens;
+    std::vector<float> embd;
+  };
+  size_t max_bytes = 0;
+  size_t n_bytes = 0;
+  std::list<entry_t> entries; // most recently used first
+  std::unordered_map<uint64_t, std::list<entry_t>::iterator> index;
+
+  static uint64_t get_key(const std::vector<llama_token> &tokens, int32_t pooling)
+  {
+    uint64_t h = fnv1a_64(&pooling, sizeof(pooling));
+    return fnv1a_64(tokens.data(), tokens.size() * sizeof(llama_token), h);
+  }
+
+  const std::vector<float> *get(const std::vector<llama_token> &tokens, int32_t pooling)
+  {
+    auto it = index.find(get_key(tokens, pooling));
+    if (it == index.end() || it->second->pooling != pooling || it->second->tokens != tokens)
+    {
+      return nullptr;
+    }
+    entries.splice(entries.begin(), entries, it->second);
+    return &it->second->embd;
+  }
+
+  void put(const std::vector<llama_token> &tokens, int32_t pooling, const float *embd, size_t n_embd)
+  {
+    if (max_bytes == 0)
+    {
+      return;
+    }
+    uint64_t key = get_key(tokens, pooling);
+    auto it = index.find(key);
+    if (it != index.end())
+    {
+      erase(it->second);
+    }
+    entries.push_front(entry_t{key, pooling, tokens, std::vector<float>(embd, embd + n_embd)});
+    index[key] = entries.begin();
+    n_bytes += get_size(entries.front());
+    evict();
+  }
+
+  void set_max_bytes(size_t n)
+  {
+    max_bytes = n;
+    evict();
+  }
+
+  void clear()
+  {
+    entries.clear();
+    index.clear();
+    n_bytes = 0;
+  }
+
+private:
+  static size_t get_size(const entry_t &e)
+  {
+    return e.tokens.size() * sizeof(llama_token) + e.embd.size() * sizeof(float);
+  }
+
+  void evict()
+  {
+    while (!entries.empty() && n_bytes > max_bytes)
+    {
+      erase(std::prev(entries.end()));
+    }
+  }
+
+  void erase(std::list<entry_t>::iterator it)
+  {
+    auto idx = index.find(it->key);
+    if (idx != index.end() && idx->second == it)
+    {
+      index.erase(idx);
+    }
+    n_bytes -= get_size(*it);
+    entries.erase(it);
+  }
+};
+
+// LRU cache of tokenized texts, keyed by (text, special); it is cleared when the model is unloaded
+struct tokenize_cache_t
+{
+  struct entry_t
+  {
+    std::string text;
+    bool special;
+    std::vector<llama_token> tokens;
+  };
+  size_t max_entries = 32;
+  size_t max_bytes = 8 * 1024 * 1024;
+  size_t n_bytes = 0;
+  std::list<entry_t> entries; // most recently used first
+  std::unordered_map<size_t, std::list<entry_t>::iterator> index;
+
+  const std::vector<llama_token> *get(const std::string &text, bool special)
+  {
+    auto it = index.find(get_key(text, special));
+    if (it == index.end() || it->second->special != special || it->second->text != text)
+    {
+      return nullptr;
+    }
+    entries.splice(entries.begin(), entries, it->second);
+    return &it->second->tokens;
+  }
+
+  // find the longest cached text which is a prefix of the given text
+  const entry_t *find_prefix(const std::string &text, bool special) const
+  {
+    const entry_t *best = nullptr;
+    for (auto &e : entries)
+    {
+      if (e.special == special && e.text.size() < text.size() && (best == nullptr || e.text.size() > best->text.size()) && text.compare(0, e.text.size(), e.text) == 0)
+      {
+        best = &e;
+      }
+    }
+    return best;
+  }
+
+  void put(const std::string &text, bool special, const std::vector<llama_token> &tokens)
+  {
+    size_t key = get_key(text, special);
+    auto it = index.find(key);
+    if (it != index.end())
+    {
+      erase(it->second);
+    }
+    entries.push_front(entry_t{text, special, tokens});
+    index[key] = entries.begin();
+    n_bytes += get_size(entries.front());
+    while (entries.size() > 1 && (entries.size() > max_entries || n_bytes > max_bytes))
+    {
+      erase(std::prev(entries.end()));
+    }
+  }
+
+  void clear()
+  {
+    entries.clear();
+    index.clear();
+    n_bytes = 0;
+  }
+
+private:
+  static size_t get_key(const std::string &text, bool special)
+  {
+    return std::hash<std::string>{}(text) ^ (size_t)special;
+  }
+
+  static size_t get_size(const entry_t &e)
+  {
+    return e.text.size() + e.tokens.size() * sizeof(llama_token);
+  }
+
+  void erase(std::list<entry_t>::iterator it)
+  {
+    auto idx = index.find(get_key(it->text, it->special));
+    if (idx != index.end() && idx->second == it)
+    {
+      index.erase(idx);
+    }
+    n_bytes -= get_size(*it);
+    entries.erase(it);
+  }
+};
+
+// state of a tokenize_stream session
+struct tokenize_session
+{
+  bool special = false;
+  bool is_first = true;
+  std::string carry; // text not yet tokenized, it may end in the middle of a word
+};
+
+// if no word boundary is found within this many bytes, the carried text is tokenized anyway
+#define TOKENIZE_STREAM_MAX_CARRY (1024 * 1024)
+
+// in-memory snapshots of the KV cache of seq 0, mapped by name
+// LRU bounded by max_bytes; buffers of overwritten or evicted snapshots are kept in a small pool and reused by the next save
+struct kv_snapshot_store
+{
+  struct entry_t
+  {
+    std::string name;
+    std::vector<uint8_t> data;
+    std::vector<llama_token> tokens;
+  };
+  size_t max_bytes = 256 * 1024 * 1024;
+  size_t n_bytes = 0;
+  size_t max_pool = 2;
+  std::list<entry_t> entries; // most recently used first
+  std::unordered_map<std::string, std::list<entry_t>::iterator> index;
+  std::vector<std::vector<uint8_t>> pool;
+
+  entry_t *get(const std::string &name)
+  {
+    auto it = index.find(name);
+    if (it == index.end())
+    {
+      return nullptr;
+    }
+    entries.splice(entries.begin(), entries, it->second);
+    return &(*it->second);
+  }
+
+  // get a buffer of the given size, reusing a pooled one when possible
+  // existing snapshots are left untouched, a snapshot with the same name is only replaced by put()
+  std::vector<uint8_t> take_buffer(size_t size)
+  {
+    std::vector<uint8_t> buf;
+    for (size_t i = 0; i < pool.size(); i++)
+    {
+      if (pool[i].capacity() >= size)
+      {
+        buf = std::move(pool[i]);
+        pool.erase(pool.begin() + i);
+        break;
+      }
+    }
+    buf.resize(size);
+    return buf;
+  }
+
+  // give back a buffer which was not used, for example because the save failed
+  void release_buffer(std::vector<uint8_t> &&buf)
+  {
+    if (pool.size() < max_pool && buf.capacity() > 0)
+    {
+      pool.push_back(std::move(buf));
+    }
+  }
+
+  void put(const std::string &name, std::vector<uint8_t> &&data, const std::vector<llama_token> &tokens)
+  {
+    auto it = index.find(name);
+    if (it != index.end())
+    {
+      erase(it->second);
+    }
+    entries.push_front(entry_t{name, std::move(data), tokens});
+    index[name] = entries.begin();
+    n_bytes += get_size(entries.front());
+    evict();
+  }
+
+  bool remove(const std::string &name)
+  {
+    auto it = index.find(name);
+    if (it == index.end())
+    {
+      return false;
+    }
+    erase(it->second);
+    return true;
+  }
+
+  void set_max_bytes(size_t n)
+  {
+    max_bytes = n;
+    evict();
+  }
+
+  void clear()
+  {
+    entries.clear();
+    index.clear();
+    pool.clear();
+    n_bytes = 0;
+  }
+
+private:
+  static size_t get_size(const entry_t &e)
+  {
+    return e.data.size() + e.tokens.size() * sizeof(llama_token);
+  }
+
+  // the most recent snapshot is always kept, even if it exceeds the budget on its own
+  void evict()
+  {
+    while (entries.size() > 1 && n_bytes > max_bytes)
+    {
+      erase(std::prev(entries.end()));
+    }
+  }
+
+  void erase(std::list<entry_t>::iterator it)
+  {
+    index.erase(it->name);
+    n_bytes -= get_size(*it);
+    release_buffer(std::move(it->data));
+    entries.erase(it);
+  }
+};
+
+#define SESSION_FILE_MAGIC 0x53534c57 // "WLSS"
+#define SESSION_FILE_VERSION 1
+#define SESSION_BLOCK_SIZE (1024 * 1024)
+#define SESSION_CHUNK_SIZE (16 * 1024 * 1024)
+#define SESSION_MAX_CHUNK_SIZE ((uint64_t)1024 * 1024 * 1024) // larger chunks are rejected instead of allocated
+#define SESSION_READ_SIZE (256 * 1024)
+
+// header of a session file, followed by n_tokens tokens, then n_chunks chunks
+// each chunk is the state of a range of positions of seq 0, restored independently: chunk_size (uint64), then blocks of up to SESSION_BLOCK_SIZE bytes
+// each block is raw_size (uint32), stored_size (uint32), data; data is LZ-compressed, unless stored_size == raw_size
+struct session_file_header
+{
+  uint32_t magic;
+  uint32_t version;
+  uint64_t model_fingerprint;
+  uint64_t cparams_fingerprint;
+  int32_t type_k;
+  int32_t type_v;
+  uint32_t n_tokens;
+  uint32_t n_chunks;
+  uint64_t state_size; // sum of the chunk sizes
+};
+
+// incremental parser of a session file, fed with pieces of any size; only one chunk is held in memory at a time
+struct session_reader_t
+{
+  enum stage_t
+  {
+    HEADER,
+    TOKENS,
+    CHUNK,
+    BLOCK,
+    BLOCK_DATA,
+    DONE,
+  };
+  stage_t stage = HEADER;
+  size_t need = sizeof(session_file_header); // number of bytes expected in pending before the next step
+  std::vector<uint8_t> pending;
+  session_file_header header;
+  std::vector<llama_token> tokens;
+  std::vector<uint8_t> chunk; // grows as blocks are decoded, up to chunk_size
+  size_t chunk_size = 0;
+  size_t chunk_offset = 0;
+  uint32_t chunk_index = 0;
+  uint64_t state_read = 0;
+  uint32_t block_sizes[2] = {0, 0};
+  std::string error;
+};
+
+// chain of incremental checkpoints of seq 0: parts[0] holds the cells of positions [0, part_end[0]),
+// parts[i] holds the cells of positions [part_end[i - 1], part_end[i])
+struct kv_checkpoint
+{
+  std::vector<llama_token> tokens;
+  std::vector<std::vector<uint8_t>> parts;
+  std::vector<size_t> part_end;
+
+  size_t get_n_bytes() const
+  {
+    size_t n = 0;
+    for (auto &p : parts)
+    {
+      n += p.size();
+    }
+    return n;
+  }
+};
+
 struct app_t
 {
   llama_model *model;
   llama_context *ctx;
   common_sampler *ctx_sampling = nullptr;
+  common_params_sampling sampling_params; // params used to create ctx_sampling
+  stop_string_matcher stop_matcher;
+  // incremental detokenizers, mapped by seq_id; seq_id = 0 is also used by sampling_sample
+  std::unordered_map<llama_seq_id, stream_detokenizer> detokenizers;
+  bool add_space_prefix = false;
+  // pieces of all tokens, concatenated; built when the model is loaded, see token_piece()
+  std::vector<char> vocab_pieces;
+  std::vector<int32_t> vocab_offsets; // n_vocab + 1 elements
+  std::vector<int32_t> vocab_attrs;
+  // map piece => token ID, built on the first lookup_token; keys point to vocab_pieces
+  std::unordered_map<std::string_view, llama_token> piece_to_token;
+  tokenize_cache_t tokenize_cache;
+  std::unordered_map<int32_t, vector_index> vector_indexes;
+  int32_t vector_index_next_handle = 1;
+  embd_cache_t embd_cache;
+  std::vector<float> embd_projection; // dims x n_embd, row-major
+  uint64_t model_fingerprint = 0;
+  uint64_t cparams_fingerprint = 0; // context params changing the content of the KV cache
+  ggml_type cache_type_k = GGML_TYPE_F16;
+  ggml_type cache_type_v = GGML_TYPE_F16;
   llama_batch batch = llama_batch_init(512, 0, 1);
   std::vector<llama_token> tokens;
+  std::vector<llama_token> encoded_tokens; // source of the encoder output currently held by the context
   int32_t seed = LLAMA_DEFAULT_SEED;
+  int32_t n_threads = 1;
+  // scratch output for wllama.action_bin, only valid until the next action
+  std::vector<char> out_buf;
+  // input buffers of wllama.action_bin, see alloc_in_buf; only valid until the next action
+  std::vector<char> in_buf;
+  kv_snapshot_store kv_snapshots;
+  std::unordered_map<std::string, kv_checkpoint> kv_checkpoints;
+  std::unique_ptr<session_reader_t> session_reader; // see session_load_begin
+  // snapshots of ctx_sampling, mapped by handle
+  // the position in the stop strings and the detokenizer of seq 0 are saved too, as sampling_sample advances them before the token is accepted
+  struct sampling_snapshot
+  {
+    common_sampler *smpl;
+    int32_t stop_state;
+    std::string stop_pending;
+    stream_detokenizer detok;
+  };
+  std::unordered_map<int32_t, sampling_snapshot> sampling_snapshots;
+  int32_t sampling_snapshot_next_handle = 1;
+  std::unordered_map<int32_t, tokenize_session> tokenize_sessions;
+  int32_t tokenize_session_next_handle = 1;
 };
 
+// get the piece of a token from the pre-computed table, the same as common_token_to_piece(ctx, id, true)
+inline std::string_view token_piece(const app_t &app, llama_token id)
+{
+  if (id < 0 || id + 1 >= (llama_token)app.vocab_offsets.size())
+  {
+    return std::string_view();
+  }
+  int32_t start = app.vocab_offsets[id];
+  return std::string_view(app.vocab_pieces.data() + start, app.vocab_offsets[id + 1] - start);
+}
+
 inline void send_response(json data)
 {
   std::cout << data.dump() << "\n";
 }
 
-inline std::vector<unsigned int> convert_string_to_int_arr(std::string &input)
+inline std::vector<unsigned int> convert_string_to_int_arr(std::string_view input)
 {
   std::vector<unsigned int> output;
   unsigned char *input_ptr = (unsigned char *)input.data();
@@ -58,6 +688,13 @@ inline std::vector<unsigned int> convert_string_to_int_arr(std::string &input)
   return std::move(output);
 }
 
+// describe a memory region to be copied out of the heap, see "wllama.action_bin" in llama-cpp.js
+// the region must stay valid until the action returns
+inline json heap_region(const void *ptr, size_t size)
+{
+  return json::array({(uintptr_t)ptr, size});
+}
+
 inline static ggml_type kv_cache_type_from_str(const std::string &s)
 {
   if (s == "f32")
@@ -87,9 +724,35 @@ inline static enum llama_pooling_type pooling_type_from_str(const std::string &s
     return LLAMA_POOLING_TYPE_MEAN;
   if (s == "LLAMA_POOLING_TYPE_CLS")
     return LLAMA_POOLING_TYPE_CLS;
+  if (s == "LLAMA_POOLING_TYPE_LAST")
+    return LLAMA_POOLING_TYPE_LAST;
+  if (s == "LLAMA_POOLING_TYPE_RANK")
+    return LLAMA_POOLING_TYPE_RANK;
   throw std::runtime_error("Invalid pooling type: " + s);
 }
 
+// output format of embeddings, see pack_embeddings
+enum embd_format
+{
+  EMBD_FORMAT_F32,
+  EMBD_FORMAT_F16,
+  EMBD_FORMAT_INT8,
+  EMBD_FORMAT_BINARY,
+};
+
+inline static embd_format embd_format_from_str(const std::string &s)
+{
+  if (s == "f32")
+    return EMBD_FORMAT_F32;
+  if (s == "f16")
+    return EMBD_FORMAT_F16;
+  if (s == "int8")
+    return EMBD_FORMAT_INT8;
+  if (s == "binary")
+    return EMBD_FORMAT_BINARY;
+  throw std::runtime_error("Invalid embeddings format: " + s);
+}
+
 inline static llama_rope_scaling_type rope_scaling_type_from_str(const std::string &s)
 {
   if (s == "LLAMA_ROPE_SCALING_TYPE_UNSPECIFIED")
@@ -103,6 +766,29 @@ inline static llama_rope_scaling_type rope_scaling_type_from_str(const std::stri
   throw std::runtime_error("Invalid RoPE scaling type: " + s);
 }
 
+inline static common_sampler_type sampler_type_from_str(const std::string &s)
+{
+  if (s == "penalties")
+    return COMMON_SAMPLER_TYPE_PENALTIES;
+  if (s == "dry")
+    return COMMON_SAMPLER_TYPE_DRY;
+  if (s == "top_k")
+    return COMMON_SAMPLER_TYPE_TOP_K;
+  if (s == "typ_p" || s == "typical_p")
+    return COMMON_SAMPLER_TYPE_TYPICAL_P;
+  if (s == "top_p")
+    return COMMON_SAMPLER_TYPE_TOP_P;
+  if (s == "min_p")
+    return COMMON_SAMPLER_TYPE_MIN_P;
+  if (s == "xtc")
+    return COMMON_SAMPLER_TYPE_XTC;
+  if (s == "temperature" || s == "temp")
+    return COMMON_SAMPLER_TYPE_TEMPERATURE;
+  if (s == "infill")
+    return COMMON_SAMPLER_TYPE_INFILL;
+  throw std::runtime_error("Invalid sampler type: " + s);
+}
+
 class app_exception : public std::exception
 {
 public:
@@ -122,6 +808,51 @@ void free_all(app_t &app)
     llama_free_model(app.model);
   if (app.ctx_sampling != nullptr)
     common_sampler_free(app.ctx_sampling);
+  app.ctx_sampling = nullptr;
+  app.detokenizers.clear();
+  std::unordered_map<std::string_view, llama_token>().swap(app.piece_to_token);
+  std::vector<char>().swap(app.vocab_pieces);
+  std::vector<int32_t>().swap(app.vocab_offsets);
+  std::vector<int32_t>().swap(app.vocab_attrs);
+  std::vector<char>().swap(app.out_buf);
+  std::vector<char>().swap(app.in_buf);
+  app.kv_snapshots.clear();
+  app.kv_checkpoints.clear();
+  app.session_reader.reset();
+  app.tokenize_cache.clear();
+  app.encoded_tokens.clear();
+  app.embd_cache.clear();
+  std::vector<float>().swap(app.embd_projection);
+  app.tokenize_sessions.clear();
+  for (auto &it : app.sampling_snapshots)
+    common_sampler_free(it.second.smpl);
+  app.sampling_snapshots.clear();
+}
+
+// pre-compute the piece of all tokens, so that detokenizing does not need to call into the vocab nor allocate
+static void build_piece_table(app_t &app)
+{
+  int32_t max_tokens = llama_n_vocab(app.model);
+  app.vocab_pieces.clear();
+  app.vocab_pieces.reserve(max_tokens * 8);
+  app.vocab_offsets.resize(max_tokens + 1);
+  app.vocab_attrs.resize(max_tokens);
+  app.vocab_offsets[0] = 0;
+  std::vector<char> buf(256);
+  for (int32_t id = 0; id < max_tokens; id++)
+  {
+    int32_t n = llama_token_to_piece(app.model, id, buf.data(), buf.size(), 0, true);
+    if (n < 0)
+    {
+      buf.resize(-n);
+      n = llama_token_to_piece(app.model, id, buf.data(), buf.size(), 0, true);
+    }
+    app.vocab_pieces.insert(app.vocab_pieces.end(), buf.data(), buf.data() + n);
+    app.vocab_offsets[id + 1] = app.vocab_pieces.size();
+    app.vocab_attrs[id] = llama_token_get_attr(app.model, id);
+    if (llama_token_is_eog(app.model, id))
+      app.vocab_attrs[id] |= WLLAMA_TOKEN_ATTR_EOG;
+  }
 }
 
 json dump_metadata(app_t &app)
@@ -157,6 +888,35 @@ json dump_metadata(app_t &app)
   return output;
 }
 
+// identify the loaded model by its description, size and metadata, used to check that a saved file belongs to this model
+static uint64_t get_model_fingerprint(app_t &app)
+{
+  char desc[128];
+  int32_t n = llama_model_desc(app.model, desc, sizeof(desc));
+  uint64_t h = fnv1a_64(desc, std::max(n, 0));
+  uint64_t sizes[2] = {llama_model_size(app.model), llama_model_n_params(app.model)};
+  h = fnv1a_64(sizes, sizeof(sizes), h);
+  std::string metadata = dump_metadata(app).dump();
+  return fnv1a_64(metadata.data(), metadata.size(), h);
+}
+
+// hash of the context params which change the content of the KV cache (cache types and RoPE)
+static uint64_t get_cparams_fingerprint(const llama_context_params &cparams)
+{
+  int32_t ints[4] = {(int32_t)cparams.type_k, (int32_t)cparams.type_v, (int32_t)cparams.rope_scaling_type, (int32_t)cparams.yarn_orig_ctx};
+  float floats[6] = {cparams.rope_freq_base, cparams.rope_freq_scale, cparams.yarn_ext_factor, cparams.yarn_attn_factor, cparams.yarn_beta_fast, cparams.yarn_beta_slow};
+  uint64_t h = fnv1a_64(ints, sizeof(ints));
+  return fnv1a_64(floats, sizeof(floats), h);
+}
+
+// 64-bit fingerprints do not fit in a JS number, they are passed as hex strings
+static std::string fingerprint_to_hex(uint64_t h)
+{
+  char buf[17];
+  snprintf(buf, sizeof(buf), "%016llx", (unsigned long long)h);
+  return buf;
+}
+
 //////////////////////////////////////////
 //////////////////////////////////////////
 //////////////////////////////////////////
@@ -178,6 +938,7 @@ json action_load(app_t &app, json &body)
   cparams.n_ctx = body["n_ctx"];
   cparams.n_threads = body["n_threads"];
   cparams.n_threads_batch = cparams.n_threads;
+  app.n_threads = cparams.n_threads;
   if (body.contains("embeddings"))
     cparams.embeddings = body["embeddings"];
   if (body.contains("offload_kqv"))
@@ -209,7 +970,7 @@ json action_load(app_t &app, json &body)
   if (body.contains("cache_type_k"))
     cparams.type_k = kv_cache_type_from_str(body["cache_type_k"]);
   if (body.contains("cache_type_v"))
-    cparams.type_k = kv_cache_type_from_str(body["cache_type_v"]);
+    cparams.type_v = kv_cache_type_from_str(body["cache_type_v"]);
   app.model = llama_load_model_from_file(model_path.c_str(), mparams);
   if (app.model == nullptr)
   {
@@ -241,6 +1002,19 @@ json action_load(app_t &app, json &body)
   }
   llama_batch_free(app.batch);
   app.batch = llama_batch_init(cparams.n_batch, 0, 1);
+  build_piece_table(app);
+  app.model_fingerprint = get_model_fingerprint(app);
+  app.cparams_fingerprint = get_cparams_fingerprint(cparams);
+  app.cache_type_k = cparams.type_k;
+  app.cache_type_v = cparams.type_v;
+  {
+    // same default as llama_vocab, used by the streaming detokenizer to strip the space after BOS
+    char buf[8];
+    int32_t res = llama_model_meta_val_str(app.model, "tokenizer.ggml.add_space_prefix", buf, sizeof(buf));
+    app.add_space_prefix = res >= 0
+                               ? std::string(buf) == "true"
+                               : llama_vocab_type(app.model) == LLAMA_VOCAB_TYPE_SPM;
+  }
   auto decoder_start_token = llama_model_decoder_start_token(app.model);
   if (decoder_start_token < 0)
   {
@@ -251,6 +1025,7 @@ json action_load(app_t &app, json &body)
       {"n_ctx", cparams.n_ctx},
       {"n_batch", llama_n_batch(app.ctx)},
       {"n_ubatch", llama_n_ubatch(app.ctx)},
+      {"n_seq_max", llama_n_seq_max(app.ctx)},
       {"n_vocab", llama_n_vocab(app.model)},
       {"n_ctx_train", llama_n_ctx_train(app.model)},
       {"n_embd", llama_n_embd(app.model)},
@@ -263,6 +1038,8 @@ json action_load(app_t &app, json &body)
       {"add_eos_token", llama_add_eos_token(app.model) == 1},
       {"has_encoder", llama_model_has_encoder(app.model)},
       {"token_decoder_start", llama_model_decoder_start_token(app.model)},
+      {"model_fingerprint", fingerprint_to_hex(app.model_fingerprint)},
+      {"cparams_fingerprint", fingerprint_to_hex(app.cparams_fingerprint)},
   };
 }
 
@@ -315,8 +1092,27 @@ json action_sampling_init(app_t &app, json &body)
     sparams.dynatemp_range = body["dynatemp_range"];
   if (body.contains("dynatemp_exponent"))
     sparams.dynatemp_exponent = body["dynatemp_exponent"];
-  // if (body.contains("samplers_sequence"))
-  //   sparams.samplers_sequence = body["samplers_sequence"];
+  // by default, top_k goes first: it truncates the list of candidates early,
+  // so the rest of the chain only works on top_k tokens instead of the whole vocab
+  sparams.samplers = {
+      COMMON_SAMPLER_TYPE_TOP_K,
+      COMMON_SAMPLER_TYPE_PENALTIES,
+      COMMON_SAMPLER_TYPE_DRY,
+      COMMON_SAMPLER_TYPE_TYPICAL_P,
+      COMMON_SAMPLER_TYPE_TOP_P,
+      COMMON_SAMPLER_TYPE_MIN_P,
+      COMMON_SAMPLER_TYPE_XTC,
+      COMMON_SAMPLER_TYPE_TEMPERATURE,
+  };
+  if (body.contains("samplers_sequence"))
+  {
+    std::vector<std::string> samplers_sequence = body["samplers_sequence"];
+    sparams.samplers.clear();
+    for (auto &name : samplers_sequence)
+    {
+      sparams.samplers.push_back(sampler_type_from_str(name));
+    }
+  }
   if (body.contains("grammar"))
     sparams.grammar = body["grammar"];
   if (body.contains("n_prev"))
@@ -346,6 +1142,14 @@ json action_sampling_init(app_t &app, json &body)
     common_sampler_free(app.ctx_sampling);
   }
   app.ctx_sampling = common_sampler_init(app.model, sparams);
+  app.sampling_params = sparams;
+  std::vector<std::string> stop_strings;
+  if (body.contains("stop_strings"))
+  {
+    stop_strings = body["stop_strings"].get<std::vector<std::string>>();
+  }
+  app.stop_matcher.init(stop_strings);
+  app.detokenizers[0].reset();
   if (body.contains("tokens"))
   {
     std::vector<llama_token> tokens = body["tokens"];
@@ -357,71 +1161,513 @@ json action_sampling_init(app_t &app, json &body)
   return json{{"success", true}};
 }
 
-// get map token ID to vocab (be careful, it is slow!)
-json action_get_vocab(app_t &app, json &body)
+// save a copy of the current sampling context (RNG, previous tokens, grammar, etc) and return its handle
+json action_sampling_snapshot(app_t &app, json &body)
 {
-  int32_t max_tokens = llama_n_vocab(app.model);
-  std::vector<std::vector<unsigned int>> vocab(max_tokens);
-  for (int32_t id = 0; id < max_tokens; id++)
+  app_t::sampling_snapshot src = {app.ctx_sampling, app.stop_matcher.state, app.stop_matcher.pending, app.detokenizers[0]};
+  if (body.contains("handle"))
   {
-    std::string token_as_str = common_token_to_piece(app.ctx, id);
-    vocab[id] = convert_string_to_int_arr(token_as_str);
+    // clone an existing snapshot instead of the current context
+    auto it = app.sampling_snapshots.find(body["handle"]);
+    if (it == app.sampling_snapshots.end())
+    {
+      return json{{"error", "invalid sampling snapshot handle"}};
+    }
+    src = it->second;
+  }
+  if (src.smpl == nullptr)
+  {
+    return json{{"error", "sampling context is not initialized"}};
   }
+  int32_t handle = app.sampling_snapshot_next_handle++;
+  src.smpl = common_sampler_clone(src.smpl);
+  app.sampling_snapshots[handle] = std::move(src);
   return json{
       {"success", true},
-      {"vocab", vocab},
+      {"handle", handle},
   };
 }
 
-// lookup single token (also be able to check if it exists or not)
-json action_lookup_token(app_t &app, json &body)
+// replace the current sampling context with a copy of the snapshot (the snapshot can be restored again later)
+json action_sampling_restore(app_t &app, json &body)
 {
-  std::string piece = body["piece"];
-  int32_t max_tokens = llama_n_vocab(app.model);
-  for (int32_t id = 0; id < max_tokens; id++)
+  auto it = app.sampling_snapshots.find(body["handle"]);
+  if (it == app.sampling_snapshots.end())
   {
-    std::string token_as_str = common_token_to_piece(app.ctx, id);
-    if (token_as_str == piece)
-    {
-      return json{
-          {"success", true},
-          {"token", id},
-      };
-    }
+    return json{{"error", "invalid sampling snapshot handle"}};
   }
-  // not found
-  return json{{"success", false}};
-}
-
-// tokenize an input string
-json action_tokenize(app_t &app, json &body)
+  if (app.ctx_sampling != nullptr)
+  {
+    common_sampler_free(app.ctx_sampling);
+  }
+  app.ctx_sampling = common_sampler_clone(it->second.smpl);
+  // the stop strings may have been changed by sampling_init since the snapshot
+  bool is_valid_state = it->second.stop_state < (int32_t)app.stop_matcher.depth.size();
+  app.stop_matcher.state = is_valid_state ? it->second.stop_state : 0;
+  app.stop_matcher.pending = is_valid_state ? it->second.stop_pending : "";
+  app.detokenizers[0] = it->second.detok;
+  return json{{"success", true}};
+}
+
+// free a snapshot
+json action_sampling_snapshot_free(app_t &app, json &body)
+{
+  auto it = app.sampling_snapshots.find(body["handle"]);
+  if (it == app.sampling_snapshots.end())
+  {
+    return json{{"error", "invalid sampling snapshot handle"}};
+  }
+  common_sampler_free(it->second.smpl);
+  app.sampling_snapshots.erase(it);
+  return json{{"success", true}};
+}
+
+// get map token ID to vocab, must be called via wllama.action_bin
+// output buffers for tokens in [start, end):
+// - offsets: int32 x (end - start + 1), offsets of each piece in the vocab (not rebased to start)
+// - attrs: int32 x (end - start), llama_token_attr flags, plus WLLAMA_TOKEN_ATTR_EOG
+// - pieces: bytes of all pieces, concatenated
+json action_get_vocab(app_t &app, json &body)
+{
+  int32_t max_tokens = llama_n_vocab(app.model);
+  int32_t start = body.contains("start") ? body.at("start").get<int32_t>() : 0;
+  int32_t end = body.contains("end") ? body.at("end").get<int32_t>() : max_tokens;
+  start = std::max(0, std::min(start, max_tokens));
+  end = std::max(start, std::min(end, max_tokens));
+  int32_t piece_start = app.vocab_offsets[start];
+  int32_t piece_end = app.vocab_offsets[end];
+  return json{
+      {"success", true},
+      {"n_vocab", max_tokens},
+      {"start", start},
+      {"end", end},
+      {"__buffers", {
+                        heap_region(app.vocab_offsets.data() + start, (end - start + 1) * sizeof(int32_t)),
+                        heap_region(app.vocab_attrs.data() + start, (end - start) * sizeof(int32_t)),
+                        heap_region(app.vocab_pieces.data() + piece_start, piece_end - piece_start),
+                    }},
+  };
+}
+
+// build the piece => token index, only once per model
+static void build_piece_index(app_t &app)
+{
+  if (!app.piece_to_token.empty())
+  {
+    return;
+  }
+  int32_t max_tokens = llama_n_vocab(app.model);
+  app.piece_to_token.reserve(max_tokens);
+  for (int32_t id = 0; id < max_tokens; id++)
+  {
+    // in case of duplicated pieces, the first token wins
+    app.piece_to_token.emplace(token_piece(app, id), id);
+  }
+}
+
+// lookup single token (also be able to check if it exists or not)
+// if "pieces" is given, lookup multiple tokens at once; -1 is returned for pieces not found
+json action_lookup_token(app_t &app, json &body)
+{
+  build_piece_index(app);
+  if (body.contains("pieces"))
+  {
+    std::vector<std::string> pieces = body["pieces"];
+    std::vector<llama_token> tokens;
+    tokens.reserve(pieces.size());
+    for (auto &piece : pieces)
+    {
+      auto it = app.piece_to_token.find(piece);
+      tokens.push_back(it == app.piece_to_token.end() ? -1 : it->second);
+    }
+    return json{
+        {"success", true},
+        {"tokens", tokens},
+    };
+  }
+  std::string piece = body["piece"];
+  auto it = app.piece_to_token.find(piece);
+  if (it != app.piece_to_token.end())
+  {
+    return json{
+        {"success", true},
+        {"token", it->second},
+    };
+  }
+  // not found
+  return json{{"success", false}};
+}
+
+// run fn(i) for i in [0, n), spread over n_threads threads (only in multi-thread build)
+// fn must be thread-safe, it must not call llama_decode
+template <typename F>
+static void parallel_for(size_t n, int32_t n_threads, const F &fn)
+{
+#ifdef __EMSCRIPTEN_PTHREADS__
+  n_threads = std::min<int32_t>(n_threads, n);
+  if (n_threads > 1)
+  {
+    std::atomic<size_t> next(0);
+    auto worker = [&]()
+    {
+      for (size_t i = next++; i < n; i = next++)
+      {
+        fn(i);
+      }
+    };
+    std::vector<std::thread> threads;
+    for (int32_t t = 1; t < n_threads; t++)
+    {
+      threads.emplace_back(worker);
+    }
+    worker();
+    for (auto &t : threads)
+    {
+      t.join();
+    }
+    return;
+  }
+#else
+  (void)n_threads;
+#endif
+  for (size_t i = 0; i < n; i++)
+  {
+    fn(i);
+  }
+}
+
+// tokenize multiple input strings, must be called via wllama.action_bin
+// output buffer: int32 offsets x (n_texts + 1), followed by all tokens concatenated
+// if count_only is set, only the number of tokens of each text is returned
+static json tokenize_batch(app_t &app, json &body)
+{
+  std::vector<std::string> texts = body["texts"];
+  bool special = body.contains("special");
+  bool count_only = body.contains("count_only") && body.at("count_only").get<bool>();
+  std::vector<std::vector<llama_token>> results(texts.size());
+  parallel_for(texts.size(), app.n_threads, [&](size_t i)
+               { results[i] = common_tokenize(app.model, texts[i], false, special); });
+  if (count_only)
+  {
+    std::vector<size_t> counts;
+    counts.reserve(results.size());
+    for (auto &r : results)
+    {
+      counts.push_back(r.size());
+    }
+    return json{
+        {"success", true},
+        {"counts", counts},
+    };
+  }
+  size_t n_tokens = 0;
+  for (auto &r : results)
+  {
+    n_tokens += r.size();
+  }
+  app.out_buf.resize((results.size() + 1 + n_tokens) * sizeof(int32_t));
+  int32_t *offsets = (int32_t *)app.out_buf.data();
+  llama_token *tokens = (llama_token *)(offsets + results.size() + 1);
+  offsets[0] = 0;
+  for (size_t i = 0; i < results.size(); i++)
+  {
+    std::copy(results[i].begin(), results[i].end(), tokens + offsets[i]);
+    offsets[i + 1] = offsets[i] + results[i].size();
+  }
+  return json{
+      {"success", true},
+      {"__buffers", {heap_region(app.out_buf.data(), app.out_buf.size())}},
+  };
+}
+
+// reuse the tokens of a cached prefix, then only tokenize the rest of the text
+// returns an empty list if no safe boundary is found, in which case the whole text must be tokenized
+static std::vector<llama_token> tokenize_from_prefix(
+    app_t &app,
+    const std::string &text,
+    bool special,
+    const std::vector<llama_token> &prefix_tokens)
+{
+  // the pieces of the prefix must reproduce the text exactly, so that we know where each token ends
+  std::vector<size_t> ends;
+  ends.reserve(prefix_tokens.size());
+  size_t pos = 0;
+  for (size_t i = 0; i < prefix_tokens.size(); i++)
+  {
+    std::string_view piece = token_piece(app, prefix_tokens[i]);
+    if (i == 0 && app.add_space_prefix && !piece.empty() && piece[0] == ' ' && text[0] != ' ')
+    {
+      piece.remove_prefix(1); // added by the tokenizer
+    }
+    if (text.compare(pos, piece.size(), piece) != 0)
+    {
+      return {};
+    }
+    pos += piece.size();
+    ends.push_back(pos);
+  }
+  // cut right before a whitespace following a non-whitespace, this is a word boundary for the pre-tokenizer, so no merge crosses it
+  auto is_space = [](char c)
+  {
+    return c == ' ' || c == '\n' || c == '\t' || c == '\r';
+  };
+  size_t n_keep = ends.size();
+  for (; n_keep > 0; n_keep--)
+  {
+    size_t cut = ends[n_keep - 1];
+    if (cut > 0 && cut < text.size() && is_space(text[cut]) && !is_space(text[cut - 1]))
+    {
+      break;
+    }
+  }
+  if (n_keep == 0)
+  {
+    return {};
+  }
+  // with space prefix, the tokenizer adds back the leading space of the rest
+  size_t cut = ends[n_keep - 1];
+  bool strip_space = app.add_space_prefix && text[cut] == ' ';
+  std::vector<llama_token> rest = common_tokenize(app.model, text.substr(cut + (strip_space ? 1 : 0)), false, special);
+  // the rest must also reproduce the text exactly
+  pos = cut;
+  for (auto id : rest)
+  {
+    std::string_view piece = token_piece(app, id);
+    if (text.compare(pos, piece.size(), piece) != 0)
+    {
+      return {};
+    }
+    pos += piece.size();
+  }
+  if (pos != text.size())
+  {
+    return {};
+  }
+  std::vector<llama_token> output(prefix_tokens.begin(), prefix_tokens.begin() + n_keep);
+  output.insert(output.end(), rest.begin(), rest.end());
+  return output;
+}
+
+// tokenize using the LRU cache; a cached prefix of the text is also reused when possible
+static std::vector<llama_token> tokenize_with_cache(app_t &app, const std::string &text, bool special)
+{
+  auto &cache = app.tokenize_cache;
+  if (auto cached = cache.get(text, special))
+  {
+    return *cached;
+  }
+  std::vector<llama_token> tokens;
+  if (auto prefix = cache.find_prefix(text, special))
+  {
+    tokens = tokenize_from_prefix(app, text, special, prefix->tokens);
+  }
+  if (tokens.empty())
+  {
+    tokens = common_tokenize(app.model, text, false, special);
+  }
+  cache.put(text, special, tokens);
+  return tokens;
+}
+
+// tokenize an input string, or multiple strings if "texts" is given
+json action_tokenize(app_t &app, json &body)
 {
+  if (body.contains("texts"))
+  {
+    return tokenize_batch(app, body);
+  }
   std::string text = body["text"];
   bool special = body.contains("special");
+  bool use_cache = body.contains("use_cache") && body.at("use_cache").get<bool>();
   std::vector<llama_token> tokens_list;
-  tokens_list = common_tokenize(app.model, text, false, special);
+  tokens_list = use_cache
+                    ? tokenize_with_cache(app, text, special)
+                    : common_tokenize(app.model, text, false, special);
   return json{
       {"success", true},
       {"tokens", tokens_list},
   };
 }
 
+// tokenize the next chunk of a tokenize_stream session, the cut is placed before the last word of the text
+// because a word may continue in the next chunk, it is carried over and tokenized together with the next chunk
+static std::vector<llama_token> tokenize_stream_chunk(app_t &app, tokenize_session &sess, bool flush)
+{
+  std::string &text = sess.carry;
+  size_t cut = text.size();
+  if (!flush && text.size() < TOKENIZE_STREAM_MAX_CARRY)
+  {
+    // cut right before a space following a non-whitespace, so that no merge crosses it
+    for (cut = text.size() - (text.empty() ? 0 : 1); cut > 0; cut--)
+    {
+      char prev = text[cut - 1];
+      if (text[cut] == ' ' && prev != ' ' && prev != '\n' && prev != '\t' && prev != '\r')
+      {
+        break;
+      }
+    }
+  }
+  else if (!flush)
+  {
+    // forced cut: do not split a UTF-8 sequence, its bytes would become byte-fallback tokens
+    size_t lead = cut;
+    while (lead > 0 && ((unsigned char)text[lead - 1] & 0xC0) == 0x80 && cut - lead < 3)
+    {
+      lead--;
+    }
+    if (lead > 0)
+    {
+      unsigned char c = text[lead - 1];
+      size_t len = c < 0x80 ? 1 : (c >> 5) == 0x6 ? 2
+                               : (c >> 4) == 0xE   ? 3
+                               : (c >> 3) == 0x1E  ? 4
+                                                   : 1;
+      if (cut - (lead - 1) < len)
+      {
+        cut = lead - 1; // the last sequence is not complete
+      }
+    }
+  }
+  if (cut == 0)
+  {
+    return {};
+  }
+  std::vector<llama_token> tokens;
+  if (!sess.is_first && app.add_space_prefix && text[0] != ' ')
+  {
+    // continuation in the middle of a word: the tokenizer would add a space prefix,
+    // so tokenize after a newline, which no merge crosses, then drop the tokens of the newline
+    std::vector<llama_token> nl = common_tokenize(app.model, "\n", false, false);
+    tokens = common_tokenize(app.model, "\n" + text.substr(0, cut), false, sess.special);
+    if (tokens.size() >= nl.size() && std::equal(nl.begin(), nl.end(), tokens.begin()))
+    {
+      tokens.erase(tokens.begin(), tokens.begin() + nl.size());
+    }
+  }
+  else
+  {
+    // with space prefix, the tokenizer adds back the leading space of a continuation chunk
+    size_t start = (!sess.is_first && app.add_space_prefix && text[0] == ' ') ? 1 : 0;
+    tokens = common_tokenize(app.model, text.substr(start, cut - start), false, sess.special);
+  }
+  text.erase(0, cut);
+  sess.is_first = false;
+  return tokens;
+}
+
+// open a session for tokenizing a large text chunk by chunk, return its handle
+json action_tokenize_stream_open(app_t &app, json &body)
+{
+  tokenize_session sess;
+  sess.special = body.contains("special");
+  int32_t handle = app.tokenize_session_next_handle++;
+  app.tokenize_sessions[handle] = std::move(sess);
+  return json{
+      {"success", true},
+      {"handle", handle},
+  };
+}
+
+// feed a chunk of text to a session, must be called via wllama.action_bin
+// output buffer: int32 x n_tokens, the tokens which are final so far
+// if "final" is set, the remaining text is flushed and the session is closed
+json action_tokenize_stream_feed(app_t &app, json &body)
+{
+  auto it = app.tokenize_sessions.find(body["handle"]);
+  if (it == app.tokenize_sessions.end())
+  {
+    return json{{"error", "invalid tokenize session handle"}};
+  }
+  bool final = body.contains("final") && body.at("final").get<bool>();
+  if (body.contains("text"))
+  {
+    it->second.carry += body.at("text").get<std::string>();
+  }
+  std::vector<llama_token> tokens = tokenize_stream_chunk(app, it->second, final);
+  if (final)
+  {
+    app.tokenize_sessions.erase(it);
+  }
+  app.out_buf.resize(tokens.size() * sizeof(llama_token));
+  std::copy(tokens.begin(), tokens.end(), (llama_token *)app.out_buf.data());
+  return json{
+      {"success", true},
+      {"__buffers", {heap_region(app.out_buf.data(), app.out_buf.size())}},
+  };
+}
+
+// discard a session without flushing its remaining text
+json action_tokenize_stream_close(app_t &app, json &body)
+{
+  auto it = app.tokenize_sessions.find(body["handle"]);
+  if (it == app.tokenize_sessions.end())
+  {
+    return json{{"error", "invalid tokenize session handle"}};
+  }
+  app.tokenize_sessions.erase(it);
+  return json{{"success", true}};
+}
+
 // detokenize a list of tokens
 json action_detokenize(app_t &app, json &body)
 {
   std::vector<llama_token> tokens = body["tokens"];
-  std::stringstream output;
+  size_t n_bytes = 0;
+  for (auto id : tokens)
+  {
+    n_bytes += token_piece(app, id).size();
+  }
+  std::string parsed_str;
+  parsed_str.reserve(n_bytes);
   for (auto id : tokens)
   {
-    output << common_token_to_piece(app.ctx, id);
+    parsed_str += token_piece(app, id);
   }
-  std::string parsed_str = output.str();
   return json{
       {"success", true},
       {"buffer", convert_string_to_int_arr(parsed_str)},
   };
 }
 
+// detokenize the next tokens of a stream, only complete UTF-8 text is returned
+// the unfinished bytes are kept per seq_id, until the next call
+json action_detokenize_stream(app_t &app, json &body)
+{
+  std::vector<llama_token> tokens = body["tokens"];
+  llama_seq_id seq_id = body.contains("seq_id") ? body.at("seq_id").get<llama_seq_id>() : 0;
+  auto &detok = app.detokenizers[seq_id];
+  if (body.contains("reset") && body.at("reset").get<bool>())
+  {
+    detok.reset();
+  }
+  const llama_token bos = llama_token_bos(app.model);
+  std::string text;
+  for (auto id : tokens)
+  {
+    if (detok.at_start && id == bos)
+    {
+      // BOS at the beginning of the stream is not rendered, the same way llama_detokenize does
+      detok.at_start = false;
+      detok.strip_next_space = app.add_space_prefix;
+      continue;
+    }
+    detok.at_start = false;
+    std::string_view piece = token_piece(app, id);
+    if (detok.strip_next_space)
+    {
+      if (!piece.empty() && piece[0] == ' ')
+        piece.remove_prefix(1);
+      detok.strip_next_space = false;
+    }
+    text += detok.feed(piece);
+  }
+  return json{
+      {"success", true},
+      {"text", text},
+      {"pending", convert_string_to_int_arr(detok.pending)},
+  };
+}
+
 // decode an array of tokens
 json action_decode(app_t &app, json &body)
 {
@@ -472,12 +1718,14 @@ json action_encode(app_t &app, json &body)
     common_batch_add(app.batch, id, n_past, {0}, false);
     n_past++;
   }
+  app.encoded_tokens.clear();
   if (llama_encode(app.ctx, app.batch) != 0)
   {
     return json{{"error", "llama_encode failed, maybe n_batch is too small?"}};
   }
   else
   {
+    app.encoded_tokens = tokens_list;
     return json{
         {"success", true},
         {"n_past", n_past},
@@ -490,11 +1738,24 @@ json action_sampling_sample(app_t &app, json &body)
 {
   int32_t idx = app.batch.n_tokens - 1;
   const llama_token new_token_id = common_sampler_sample(app.ctx_sampling, app.ctx, idx, false);
-  std::string piece = common_token_to_piece(app.ctx, new_token_id);
+  std::string_view piece = token_piece(app, new_token_id);
+  bool stopped = false;
+  std::string output;
+  if (!app.stop_matcher.empty())
+  {
+    stopped = app.stop_matcher.feed(piece, output);
+    piece = output;
+  }
+  auto &detok = app.detokenizers[0];
+  std::string text = detok.feed(piece);
+  std::string pending = detok.pending + app.stop_matcher.pending;
   return json{
       {"success", true},
       {"piece", convert_string_to_int_arr(piece)},
       {"token", new_token_id},
+      {"text", text},
+      {"stopped", stopped},
+      {"pending", convert_string_to_int_arr(pending)},
   };
 }
 
@@ -552,145 +1813,1979 @@ json action_get_logits(app_t &app, json &body)
   };
 }
 
-// get embeddings, this will call action_decode internally
-json action_embeddings(app_t &app, json &body)
+// check if the token is EOG or one of the custom stop tokens
+static bool is_stop_token(app_t &app, const std::vector<llama_token> &stop_tokens, llama_token id)
 {
-  std::vector<llama_token> tokens_list = body["tokens"];
-  // allocate output
-  const int n_embd = llama_n_embd(app.model);
-  std::vector<float> embeddings(n_embd, 0); // single seq
-  float *out = embeddings.data();
-  // decode
-  json req = json{{"tokens", tokens_list}};
-  json res = action_decode(app, req);
-  if (res.contains("error"))
+  return llama_token_is_eog(app.model, id) || std::find(stop_tokens.begin(), stop_tokens.end(), id) != stop_tokens.end();
+}
+
+// get top k tokens with their log-probability (stored in .p), sorted by descending order
+// cur is a working buffer, to avoid re-allocating n_vocab elements on each call
+static void get_top_k_logprobs(
+    const float *logits,
+    int32_t n_vocab,
+    int32_t k,
+    std::vector<llama_token_data> &cur,
+    std::vector<llama_token_data> &out)
+{
+  float max_logit = logits[0];
+  for (int32_t i = 1; i < n_vocab; i++)
   {
-    return res;
+    max_logit = std::max(max_logit, logits[i]);
   }
-  int32_t idx = app.batch.n_tokens - 1;
-  const float *embd = llama_get_embeddings_seq(app.ctx, 0);
-  if (embd == NULL)
+  double sum = 0.0;
+  cur.resize(n_vocab);
+  for (llama_token id = 0; id < n_vocab; id++)
   {
-    embd = llama_get_embeddings_ith(app.ctx, idx);
-    if (embd == NULL)
-    {
-      fprintf(stderr, "%s: failed to get embeddings for token %d\n", __func__, idx);
-      return json{{"error", "failed to get embeddings"}};
-    }
+    sum += exp(logits[id] - max_logit);
+    cur[id] = llama_token_data{id, logits[id], 0.0f};
   }
-  common_embd_normalize(embd, out, n_embd, 2);
-  return json{
-      {"success", true},
-      {"embeddings", embeddings},
+  const float log_sum = max_logit + (float)log(sum);
+  k = std::min(k, n_vocab);
+  auto cmp = [](const llama_token_data &a, const llama_token_data &b)
+  {
+    return b.logit < a.logit;
   };
+  std::partial_sort(cur.begin(), cur.begin() + k, cur.end(), cmp);
+  out.clear();
+  for (int32_t i = 0; i < k; i++)
+  {
+    out.push_back(llama_token_data{cur[i].id, cur[i].logit, cur[i].logit - log_sum});
+  }
 }
 
-// apply chat template
-json action_chat_format(app_t &app, json &body)
+// beam search, starting from the logits of the last decoded token
+// the current sequence (seq_id = 0) is left untouched, each beam lives in its own KV sequence (seq_id = 1..n_beams)
+// all beams are decoded in the same batch at each step
+// NOTE: after this, the batch no longer holds the logits of seq 0; decode the chosen hypothesis to continue generating
+json action_beam_search(app_t &app, json &body)
 {
-  std::string tmpl = body.contains("tmpl") ? body["tmpl"] : "";
-  bool add_ass = body.contains("add_ass") ? body.at("add_ass").get<bool>() : false;
-  if (!body.contains("messages"))
+  const int32_t n_predict = body["n_predict"];
+  const int32_t n_beams = body.contains("n_beams") ? body.at("n_beams").get<int32_t>() : 4;
+  const int32_t n_best = body.contains("n_best") ? body.at("n_best").get<int32_t>() : 1;
+  const float length_penalty = body.contains("length_penalty") ? body.at("length_penalty").get<float>() : 1.0f;
+  std::vector<llama_token> stop_tokens;
+  if (body.contains("stop_tokens"))
   {
-    return json{{"error", "messages is required"}};
+    stop_tokens = body["stop_tokens"].get<std::vector<llama_token>>();
   }
-  std::vector<common_chat_msg> chat;
-  for (auto &item : body["messages"])
+  if (n_beams < 1 || n_best < 1 || n_best > n_beams)
   {
-    chat.push_back({item["role"], item["content"]});
+    return json{{"error", "n_beams and n_best must be positive, n_best must not be bigger than n_beams"}};
   }
-  try
+  if ((uint32_t)n_beams + 1 > llama_n_seq_max(app.ctx))
   {
-    std::string formatted_chat = common_chat_apply_template(app.model, tmpl, chat, add_ass);
-    return json{
-        {"success", true},
-        {"formatted_chat", formatted_chat},
-    };
+    return json{{"error", "n_seq_max is too small, it must be at least n_beams + 1"}};
   }
-  catch (const std::exception &e)
+  if (app.batch.n_tokens == 0)
   {
-    return json{{"error", e.what()}};
+    return json{{"error", "no logits available, please decode the prompt first"}};
   }
-}
 
-// remove tokens in kv, for context-shifting
-json action_kv_remove(app_t &app, json &body)
-{
-  const int n_keep = body["n_keep"];
-  const int n_discard = body["n_discard"];
-  const int n_past = app.tokens.size();
-  llama_kv_cache_seq_rm(app.ctx, 0, n_keep, n_keep + n_discard);
-  llama_kv_cache_seq_add(app.ctx, 0, n_keep + n_discard, n_past, -n_discard);
-  app.tokens.erase(
-      app.tokens.begin() + n_keep,
-      app.tokens.begin() + n_keep + n_discard);
-  return json{
-      {"success", true},
-      {"n_past", app.tokens.size()},
+  struct beam_t
+  {
+    std::vector<llama_token> tokens;
+    float logprob = 0.0f;
+    llama_seq_id seq_id = 0;
+    int32_t i_batch = -1;
+    bool finished = false;
   };
-}
-
-// clear all tokens in kv
-json action_kv_clear(app_t &app, json &body)
-{
-  llama_kv_cache_clear(app.ctx);
-  app.tokens.clear();
-  return json{
-      {"success", true},
-      {"n_past", app.tokens.size()},
+  struct candidate_t
+  {
+    size_t parent;
+    llama_token id;
+    float logprob;
   };
+  auto get_score = [&](const beam_t &b)
+  {
+    // the stop token is not included in the output, but it still counts in the length
+    size_t n_tokens = b.tokens.size() + (b.finished ? 1 : 0);
+    return b.logprob / std::pow((float)std::max<size_t>(n_tokens, 1), length_penalty);
+  };
+  auto score_cmp = [&](const beam_t &a, const beam_t &b)
+  {
+    return get_score(a) > get_score(b);
+  };
+
+  const int32_t n_vocab = llama_n_vocab(app.model);
+  const llama_pos n_past = app.tokens.size();
+  std::vector<llama_seq_id> free_seqs;
+  for (llama_seq_id s = n_beams; s >= 1; s--)
+  {
+    llama_kv_cache_seq_rm(app.ctx, s, -1, -1);
+    free_seqs.push_back(s);
+  }
+  auto cleanup = [&]()
+  {
+    for (llama_seq_id s = 1; s <= n_beams; s++)
+    {
+      llama_kv_cache_seq_rm(app.ctx, s, -1, -1);
+    }
+  };
+
+  // the root beam is the current sequence
+  std::vector<beam_t> beams(1);
+  beams[0].i_batch = app.batch.n_tokens - 1;
+  std::vector<beam_t> finished;
+  std::vector<candidate_t> candidates;
+  std::vector<llama_token_data> cur;
+  std::vector<llama_token_data> top_k;
+  for (int32_t step = 0; step < n_predict; step++)
+  {
+    // expand each beam with its top n_beams tokens
+    candidates.clear();
+    for (size_t i = 0; i < beams.size(); i++)
+    {
+      const float *logits = llama_get_logits_ith(app.ctx, beams[i].i_batch);
+      get_top_k_logprobs(logits, n_vocab, n_beams, cur, top_k);
+      for (auto &td : top_k)
+      {
+        candidates.push_back(candidate_t{i, td.id, beams[i].logprob + td.p});
+      }
+    }
+    std::sort(candidates.begin(), candidates.end(), [](const candidate_t &a, const candidate_t &b)
+              { return a.logprob > b.logprob; });
+
+    // keep the best n_beams candidates; a stop token within the top n_beams finishes a hypothesis
+    std::vector<candidate_t> selected;
+    for (size_t rank = 0; rank < candidates.size() && (int32_t)selected.size() < n_beams; rank++)
+    {
+      auto &c = candidates[rank];
+      if (is_stop_token(app, stop_tokens, c.id))
+      {
+        if ((int32_t)rank < n_beams)
+        {
+          beam_t f;
+          f.tokens = beams[c.parent].tokens;
+          f.logprob = c.logprob;
+          f.finished = true;
+          finished.push_back(std::move(f));
+        }
+        continue;
+      }
+      selected.push_back(c);
+    }
+
+    // assign KV sequences: the first child reuses its parent's sequence, the others get a copy
+    std::vector<int32_t> n_children(beams.size(), 0);
+    for (auto &c : selected)
+    {
+      n_children[c.parent]++;
+    }
+    const bool is_root = step == 0;
+    if (!is_root)
+    {
+      for (size_t i = 0; i < beams.size(); i++)
+      {
+        if (n_children[i] == 0)
+        {
+          llama_kv_cache_seq_rm(app.ctx, beams[i].seq_id, -1, -1);
+          free_seqs.push_back(beams[i].seq_id);
+        }
+      }
+    }
+    std::vector<bool> parent_seq_reused(beams.size(), false);
+    std::vector<beam_t> new_beams;
+    for (auto &c : selected)
+    {
+      beam_t b;
+      b.tokens = beams[c.parent].tokens;
+      b.tokens.push_back(c.id);
+      b.logprob = c.logprob;
+      if (!is_root && !parent_seq_reused[c.parent])
+      {
+        b.seq_id = beams[c.parent].seq_id;
+        parent_seq_reused[c.parent] = true;
+      }
+      else
+      {
+        b.seq_id = free_seqs.back();
+        free_seqs.pop_back();
+        llama_kv_cache_seq_cp(app.ctx, beams[c.parent].seq_id, b.seq_id, -1, -1);
+      }
+      new_beams.push_back(std::move(b));
+    }
+    beams = std::move(new_beams);
+    if (beams.empty())
+    {
+      break;
+    }
+
+    // stop early if no alive beam can beat the n_best finished ones
+    if ((int32_t)finished.size() >= n_best)
+    {
+      std::sort(finished.begin(), finished.end(), score_cmp);
+      float worst_kept = get_score(finished[n_best - 1]);
+      float best_alive = get_score(*std::min_element(beams.begin(), beams.end(), score_cmp));
+      if (best_alive <= worst_kept)
+      {
+        break;
+      }
+    }
+    if (step == n_predict - 1)
+    {
+      break; // no need to decode the last tokens
+    }
+
+    // decode all beams in one batch
+    common_batch_clear(app.batch);
+    for (size_t i = 0; i < beams.size(); i++)
+    {
+      beams[i].i_batch = i;
+      common_batch_add(app.batch, beams[i].tokens.back(), n_past + beams[i].tokens.size() - 1, {beams[i].seq_id}, true);
+    }
+    if (llama_decode(app.ctx, app.batch) != 0)
+    {
+      cleanup();
+      return json{{"error", "llama_decode failed, maybe n_ctx is too small?"}};
+    }
+  }
+  cleanup();
+
+  // unfinished beams are also returned, in case there are not enough finished hypotheses
+  for (auto &b : beams)
+  {
+    finished.push_back(std::move(b));
+  }
+  std::sort(finished.begin(), finished.end(), score_cmp);
+  std::vector<json> output;
+  for (int32_t i = 0; i < n_best && i < (int32_t)finished.size(); i++)
+  {
+    auto &b = finished[i];
+    output.push_back(json{
+        {"tokens", b.tokens},
+        {"score", get_score(b)},
+        {"logprob", b.logprob},
+        {"finished", b.finished},
+    });
+  }
+  return json{
+      {"success", true},
+      {"hypotheses", output},
+  };
+}
+
+// for encoder-decoder models: encode the source tokens, then generate from the decoder start token followed by "prefix"
+// the encoder output stays in the context, so if the source is the same as the last encoded one, llama_encode is skipped
+// this allows multiple decoding passes (n-best, different prefixes or samplers) to reuse one encoding
+// uses the current sampling context, which is reset first
+json action_encode_generate(app_t &app, json &body)
+{
+  std::vector<llama_token> tokens_list = body["tokens"];
+  std::vector<llama_token> prefix = body.contains("prefix") ? body.at("prefix").get<std::vector<llama_token>>() : std::vector<llama_token>();
+  const int32_t n_predict = body["n_predict"];
+  std::vector<llama_token> stop_tokens;
+  if (body.contains("stop_tokens"))
+  {
+    stop_tokens = body["stop_tokens"].get<std::vector<llama_token>>();
+  }
+  if (app.ctx_sampling == nullptr)
+  {
+    return json{{"error", "sampling context is not initialized"}};
+  }
+  bool reused = tokens_list == app.encoded_tokens;
+  if (!reused)
+  {
+    json req = json{{"tokens", tokens_list}};
+    json res = action_encode(app, req);
+    if (res.contains("error"))
+    {
+      return res;
+    }
+  }
+  // decoder prompt
+  llama_token decoder_start = llama_model_decoder_start_token(app.model);
+  if (decoder_start < 0)
+  {
+    decoder_start = llama_token_bos(app.model);
+  }
+  prefix.insert(prefix.begin(), decoder_start);
+  llama_kv_cache_clear(app.ctx);
+  app.tokens.clear();
+  // fresh sampler for each pass: common_sampler_reset() would also restart the RNG from the same seed,
+  // so the seed is the one given, or the next one
+  common_params_sampling params = app.sampling_params;
+  params.seed = body.contains("seed") ? body.at("seed").get<uint32_t>() : app.sampling_params.seed + 1;
+  common_sampler_free(app.ctx_sampling);
+  app.ctx_sampling = common_sampler_init(app.model, params);
+  app.sampling_params = params;
+  json req = json{{"tokens", prefix}};
+  json res = action_decode(app, req);
+  if (res.contains("error"))
+  {
+    return res;
+  }
+  // generate
+  std::vector<llama_token> output;
+  std::string text;
+  bool finished = false;
+  for (int32_t i = 0; i < n_predict; i++)
+  {
+    llama_token id = common_sampler_sample(app.ctx_sampling, app.ctx, -1);
+    common_sampler_accept(app.ctx_sampling, id, true);
+    if (is_stop_token(app, stop_tokens, id))
+    {
+      finished = true;
+      break;
+    }
+    output.push_back(id);
+    text += token_piece(app, id);
+    if (i == n_predict - 1)
+    {
+      break; // no need to decode the last token
+    }
+    common_batch_clear(app.batch);
+    common_batch_add(app.batch, id, app.tokens.size(), {0}, true);
+    app.tokens.push_back(id);
+    if (llama_decode(app.ctx, app.batch) != 0)
+    {
+      return json{{"error", "llama_decode failed, maybe n_ctx is too small?"}};
+    }
+  }
+  return json{
+      {"success", true},
+      {"tokens", output},
+      {"buffer", convert_string_to_int_arr(text)},
+      {"finished", finished},
+      {"reused_encoding", reused},
+      {"n_past", app.tokens.size()},
+  };
+}
+
+// generate n completions in parallel, starting from the logits of the last decoded token
+// the prompt is shared: seq 0 is copied to seq_id = 1..n, each completion has its own sampler, seeded differently
+// all completions are decoded in the same batch at each step
+// NOTE: after this, the batch no longer holds the logits of seq 0
+json action_generate_parallel(app_t &app, json &body)
+{
+  const int32_t n = body["n"];
+  const int32_t n_predict = body["n_predict"];
+  std::vector<llama_token> stop_tokens;
+  if (body.contains("stop_tokens"))
+  {
+    stop_tokens = body["stop_tokens"].get<std::vector<llama_token>>();
+  }
+  if (n < 1)
+  {
+    return json{{"error", "n must be positive"}};
+  }
+  if ((uint32_t)n + 1 > llama_n_seq_max(app.ctx))
+  {
+    return json{{"error", "n_seq_max is too small, it must be at least n + 1"}};
+  }
+  if (app.batch.n_tokens == 0)
+  {
+    return json{{"error", "no logits available, please decode the prompt first"}};
+  }
+
+  struct completion_t
+  {
+    common_sampler *smpl;
+    std::vector<llama_token> tokens;
+    std::string text;
+    llama_seq_id seq_id;
+    int32_t i_batch;
+    bool finished = false;
+  };
+  // only the last tokens are needed to restore the penalties and n_prev ring buffers
+  // the grammar is not restored: tokens are accepted into ctx_sampling without it (see action_sampling_accept)
+  const auto &sparams = app.sampling_params;
+  const size_t n_history = std::min(app.tokens.size(), (size_t)std::max(sparams.n_prev, sparams.penalty_last_n));
+  const llama_pos n_past = app.tokens.size();
+  const int32_t i_batch_prompt = app.batch.n_tokens - 1;
+  std::vector<completion_t> completions(n);
+  for (int32_t i = 0; i < n; i++)
+  {
+    auto &c = completions[i];
+    common_params_sampling params = sparams;
+    params.seed = sparams.seed + i + 1;
+    c.smpl = common_sampler_init(app.model, params);
+    for (size_t j = app.tokens.size() - n_history; j < app.tokens.size(); j++)
+    {
+      common_sampler_accept(c.smpl, app.tokens[j], false);
+    }
+    c.seq_id = i + 1;
+    c.i_batch = i_batch_prompt;
+    llama_kv_cache_seq_rm(app.ctx, c.seq_id, -1, -1);
+    llama_kv_cache_seq_cp(app.ctx, 0, c.seq_id, -1, -1);
+  }
+  auto cleanup = [&]()
+  {
+    for (auto &c : completions)
+    {
+      common_sampler_free(c.smpl);
+      llama_kv_cache_seq_rm(app.ctx, c.seq_id, -1, -1);
+    }
+  };
+
+  for (int32_t step = 0; step < n_predict; step++)
+  {
+    common_batch_clear(app.batch);
+    for (auto &c : completions)
+    {
+      if (c.finished)
+      {
+        continue;
+      }
+      llama_token id = common_sampler_sample(c.smpl, app.ctx, c.i_batch, false);
+      common_sampler_accept(c.smpl, id, true);
+      if (is_stop_token(app, stop_tokens, id))
+      {
+        c.finished = true;
+        continue;
+      }
+      c.tokens.push_back(id);
+      c.text += token_piece(app, id);
+      if (step == n_predict - 1)
+      {
+        continue; // no need to decode the last tokens
+      }
+      c.i_batch = app.batch.n_tokens;
+      common_batch_add(app.batch, id, n_past + c.tokens.size() - 1, {c.seq_id}, true);
+    }
+    if (app.batch.n_tokens == 0)
+    {
+      break; // all completions are finished
+    }
+    if (llama_decode(app.ctx, app.batch) != 0)
+    {
+      cleanup();
+      return json{{"error", "llama_decode failed, maybe n_ctx is too small?"}};
+    }
+  }
+
+  std::vector<json> output;
+  for (auto &c : completions)
+  {
+    output.push_back(json{
+        {"tokens", c.tokens},
+        {"buffer", convert_string_to_int_arr(c.text)},
+        {"finished", c.finished},
+    });
+  }
+  cleanup();
+  return json{
+      {"success", true},
+      {"completions", output},
+  };
+}
+
+// pack normalized embedding vectors (n x n_dims floats) into app.out_buf, in the requested format
+// output buffers:
+// - f32: float x (n * n_dims)
+// - f16: ggml_fp16_t x (n * n_dims)
+// - int8: two buffers, int8 x (n * n_dims), then float x n, the scale of each vector (value = int8 * scale)
+//   in app.out_buf, the scales are stored before the int8 data
+// - binary: uint8 x (n * ceil(n_dims / 8)), the sign bits (1 if positive), most significant bit first
+static json pack_embeddings(app_t &app, const std::vector<float> &vecs, size_t n, size_t n_dims, embd_format format)
+{
+  switch (format)
+  {
+  case EMBD_FORMAT_F32:
+  {
+    app.out_buf.resize(vecs.size() * sizeof(float));
+    std::copy(vecs.begin(), vecs.end(), (float *)app.out_buf.data());
+    return json::array({heap_region(app.out_buf.data(), app.out_buf.size())});
+  }
+  case EMBD_FORMAT_F16:
+  {
+    app.out_buf.resize(vecs.size() * sizeof(ggml_fp16_t));
+    ggml_fp32_to_fp16_row(vecs.data(), (ggml_fp16_t *)app.out_buf.data(), vecs.size());
+    return json::array({heap_region(app.out_buf.data(), app.out_buf.size())});
+  }
+  case EMBD_FORMAT_INT8:
+  {
+    // scales are placed first to keep them aligned
+    app.out_buf.resize(n * sizeof(float) + vecs.size());
+    float *scales = (float *)app.out_buf.data();
+    int8_t *data = (int8_t *)(scales + n);
+    for (size_t i = 0; i < n; i++)
+    {
+      const float *v = vecs.data() + i * n_dims;
+      float amax = 0.0f;
+      for (size_t d = 0; d < n_dims; d++)
+      {
+        amax = std::max(amax, std::fabs(v[d]));
+      }
+      scales[i] = amax / 127.0f;
+      const float inv_scale = amax > 0.0f ? 127.0f / amax : 0.0f;
+      for (size_t d = 0; d < n_dims; d++)
+      {
+        data[i * n_dims + d] = (int8_t)std::lround(v[d] * inv_scale);
+      }
+    }
+    return json::array({
+        heap_region(data, vecs.size()),
+        heap_region(scales, n * sizeof(float)),
+    });
+  }
+  case EMBD_FORMAT_BINARY:
+  {
+    const size_t n_bytes = (n_dims + 7) / 8;
+    app.out_buf.assign(n * n_bytes, 0);
+    uint8_t *data = (uint8_t *)app.out_buf.data();
+    for (size_t i = 0; i < n; i++)
+    {
+      const float *v = vecs.data() + i * n_dims;
+      for (size_t d = 0; d < n_dims; d++)
+      {
+        if (v[d] > 0.0f)
+        {
+          data[i * n_bytes + d / 8] |= 0x80 >> (d % 8);
+        }
+      }
+    }
+    return json::array({heap_region(app.out_buf.data(), app.out_buf.size())});
+  }
+  }
+  return json::array();
+}
+
+// size of the output vector of each sequence, RANK pooling outputs a single score
+static size_t get_embd_size(app_t &app)
+{
+  return llama_pooling_type(app.ctx) == LLAMA_POOLING_TYPE_RANK ? 1 : llama_n_embd(app.model);
+}
+
+// number of dimensions to keep, for matryoshka models; 0 means all
+static size_t get_embd_dims(app_t &app, json &body)
+{
+  const size_t n_embd = get_embd_size(app);
+  size_t dims = body.contains("dims") ? body.at("dims").get<size_t>() : 0;
+  return (dims == 0 || dims > n_embd) ? n_embd : dims;
+}
+
+// get embeddings, this will call action_decode internally
+// if "format" is set, the output is packed (see pack_embeddings) and this must be called via wllama.action_bin
+// if "dims" is set, the vector is truncated to this size, then normalized
+json action_embeddings(app_t &app, json &body)
+{
+  std::vector<llama_token> tokens_list = body["tokens"];
+  // allocate output
+  const int n_embd = get_embd_dims(app, body);
+  std::vector<float> embeddings(n_embd, 0); // single seq
+  float *out = embeddings.data();
+  const int32_t pooling = llama_pooling_type(app.ctx);
+  const float *embd = nullptr;
+  if (auto cached = app.embd_cache.get(tokens_list, pooling))
+  {
+    embd = cached->data();
+  }
+  else
+  {
+    // decode
+    json req = json{{"tokens", tokens_list}};
+    json res = action_decode(app, req);
+    if (res.contains("error"))
+    {
+      return res;
+    }
+    int32_t idx = app.batch.n_tokens - 1;
+    embd = llama_get_embeddings_seq(app.ctx, 0);
+    if (embd == NULL)
+    {
+      embd = llama_get_embeddings_ith(app.ctx, idx);
+      if (embd == NULL)
+      {
+        fprintf(stderr, "%s: failed to get embeddings for token %d\n", __func__, idx);
+        return json{{"error", "failed to get embeddings"}};
+      }
+    }
+    app.embd_cache.put(tokens_list, pooling, embd, get_embd_size(app));
+  }
+  common_embd_normalize(embd, out, n_embd, 2);
+  if (body.contains("format"))
+  {
+    return json{
+        {"success", true},
+        {"n_embd", n_embd},
+        {"__buffers", pack_embeddings(app, embeddings, 1, n_embd, embd_format_from_str(body["format"]))},
+    };
+  }
+  return json{
+      {"success", true},
+      {"embeddings", embeddings},
+  };
+}
+
+// compute the normalized embeddings of multiple inputs into out (n_inputs x n_embd floats)
+// inputs are packed into as few llama_decode calls as possible, one sequence per input (up to n_ubatch tokens and n_seq_max sequences per call)
+// inputs found in the embeddings cache are not decoded
+// NOTE: this clears the KV cache
+static json embeddings_batch(
+    app_t &app,
+    const std::vector<std::vector<llama_token>> &inputs,
+    int n_embd,
+    int32_t normalize,
+    float *out)
+{
+  const size_t n_tokens_max = llama_n_ubatch(app.ctx);
+  const size_t n_seq_max = llama_n_seq_max(app.ctx);
+  for (auto &input : inputs)
+  {
+    if (input.empty())
+    {
+      return json{{"error", "input must not be empty"}};
+    }
+    if (input.size() > n_tokens_max)
+    {
+      return json{{"error", "input does not fit into physical batch, maybe n_ubatch is too small?"}};
+    }
+  }
+  // inputs found in the cache do not need to be decoded
+  const int32_t pooling = llama_pooling_type(app.ctx);
+  std::vector<size_t> pending;
+  for (size_t i = 0; i < inputs.size(); i++)
+  {
+    if (auto cached = app.embd_cache.get(inputs[i], pooling))
+    {
+      common_embd_normalize(cached->data(), out + i * n_embd, n_embd, normalize);
+    }
+    else
+    {
+      pending.push_back(i);
+    }
+  }
+  app.tokens.clear();
+  size_t i = 0;
+  while (i < pending.size())
+  {
+    // fill the batch, input pending[i + s] goes to sequence s
+    llama_kv_cache_clear(app.ctx);
+    common_batch_clear(app.batch);
+    size_t n_seq = 0;
+    while (i + n_seq < pending.size() && n_seq < n_seq_max && app.batch.n_tokens + inputs[pending[i + n_seq]].size() <= n_tokens_max)
+    {
+      auto &input = inputs[pending[i + n_seq]];
+      for (size_t p = 0; p < input.size(); p++)
+      {
+        common_batch_add(app.batch, input[p], p, {(llama_seq_id)n_seq}, true);
+      }
+      n_seq++;
+    }
+    if (llama_decode(app.ctx, app.batch) != 0)
+    {
+      llama_kv_cache_clear(app.ctx);
+      return json{{"error", "llama_decode failed, maybe n_batch is too small?"}};
+    }
+    // read the pooled embeddings, or the last token if pooling is disabled
+    int32_t idx = -1;
+    for (size_t s = 0; s < n_seq; s++)
+    {
+      auto &input = inputs[pending[i + s]];
+      idx += input.size();
+      const float *embd = llama_get_embeddings_seq(app.ctx, s);
+      if (embd == NULL)
+      {
+        embd = llama_get_embeddings_ith(app.ctx, idx);
+        if (embd == NULL)
+        {
+          llama_kv_cache_clear(app.ctx);
+          return json{{"error", "failed to get embeddings"}};
+        }
+      }
+      app.embd_cache.put(input, pooling, embd, get_embd_size(app));
+      common_embd_normalize(embd, out + pending[i + s] * n_embd, n_embd, normalize);
+    }
+    i += n_seq;
+  }
+  llama_kv_cache_clear(app.ctx);
+  return json{{"success", true}};
+}
+
+// get embeddings of multiple inputs, must be called via wllama.action_bin
+// output buffers: one normalized vector per input, packed in "format" (default to f32, see pack_embeddings)
+// NOTE: this clears the KV cache
+json action_embeddings_batch(app_t &app, json &body)
+{
+  std::vector<std::vector<llama_token>> inputs = body["inputs"];
+  int32_t normalize = body.contains("normalize") ? body.at("normalize").get<int32_t>() : 2;
+  embd_format format = body.contains("format") ? embd_format_from_str(body["format"]) : EMBD_FORMAT_F32;
+  const int n_embd = get_embd_dims(app, body);
+  std::vector<float> embeddings(inputs.size() * n_embd);
+  json res = embeddings_batch(app, inputs, n_embd, normalize, embeddings.data());
+  if (res.contains("error"))
+  {
+    return res;
+  }
+  return json{
+      {"success", true},
+      {"n_embd", n_embd},
+      {"__buffers", pack_embeddings(app, embeddings, inputs.size(), n_embd, format)},
+  };
+}
+
+// embed a document longer than n_ubatch: tokens are split into overlapping windows, embedded in batches, then pooled
+// - "window", "overlap": size of windows and number of tokens shared by consecutive windows, in tokens
+// - "prefix", "suffix": tokens added to each window, for example BOS and EOS
+// - "pooling": "mean" (default) or "weighted" (by number of tokens in the window)
+// must be called via wllama.action_bin, output buffer: float x n_embd for the pooled vector, followed by one vector per window if "return_windows" is set
+// NOTE: this clears the KV cache
+json action_embeddings_long(app_t &app, json &body)
+{
+  std::vector<llama_token> tokens = body["tokens"];
+  std::vector<llama_token> prefix = body.contains("prefix") ? body.at("prefix").get<std::vector<llama_token>>() : std::vector<llama_token>();
+  std::vector<llama_token> suffix = body.contains("suffix") ? body.at("suffix").get<std::vector<llama_token>>() : std::vector<llama_token>();
+  const size_t n_extra = prefix.size() + suffix.size();
+  const size_t n_ubatch = llama_n_ubatch(app.ctx);
+  if (n_extra >= n_ubatch)
+  {
+    return json{{"error", "prefix and suffix do not fit into physical batch"}};
+  }
+  size_t window = body.contains("window") ? body.at("window").get<size_t>() : 0;
+  if (window == 0 || window > n_ubatch - n_extra)
+  {
+    window = n_ubatch - n_extra;
+  }
+  size_t overlap = body.contains("overlap") ? body.at("overlap").get<size_t>() : window / 4;
+  if (overlap >= window)
+  {
+    return json{{"error", "overlap must be smaller than window"}};
+  }
+  std::string pooling = body.contains("pooling") ? body.at("pooling").get<std::string>() : "mean";
+  if (pooling != "mean" && pooling != "weighted")
+  {
+    throw std::runtime_error("Invalid pooling: " + pooling);
+  }
+  bool return_windows = body.contains("return_windows") && body.at("return_windows").get<bool>();
+  int32_t normalize = body.contains("normalize") ? body.at("normalize").get<int32_t>() : 2;
+  const int n_embd = get_embd_dims(app, body);
+  // split into windows
+  std::vector<std::vector<llama_token>> inputs;
+  json ranges = json::array();
+  for (size_t start = 0; start < tokens.size() || inputs.empty(); start += window - overlap)
+  {
+    size_t end = std::min(start + window, tokens.size());
+    std::vector<llama_token> input(prefix);
+    input.insert(input.end(), tokens.begin() + start, tokens.begin() + end);
+    input.insert(input.end(), suffix.begin(), suffix.end());
+    inputs.push_back(std::move(input));
+    ranges.push_back({start, end});
+    if (end == tokens.size())
+    {
+      break;
+    }
+  }
+  // row 0 is the pooled vector, then one row per window
+  std::vector<float> embeddings((inputs.size() + 1) * n_embd, 0.0f);
+  json res = embeddings_batch(app, inputs, n_embd, 2, embeddings.data() + n_embd);
+  if (res.contains("error"))
+  {
+    return res;
+  }
+  std::vector<float> pooled(n_embd, 0.0f);
+  float sum_weights = 0.0f;
+  for (size_t i = 0; i < inputs.size(); i++)
+  {
+    const float weight = pooling == "weighted" ? (float)(inputs[i].size() - n_extra) : 1.0f;
+    const float *v = embeddings.data() + (i + 1) * n_embd;
+    for (int d = 0; d < n_embd; d++)
+    {
+      pooled[d] += weight * v[d];
+    }
+    sum_weights += weight;
+  }
+  for (int d = 0; d < n_embd; d++)
+  {
+    pooled[d] /= std::max(sum_weights, 1e-6f);
+  }
+  common_embd_normalize(pooled.data(), embeddings.data(), n_embd, normalize);
+  if (!return_windows)
+  {
+    embeddings.resize(n_embd);
+  }
+  return json{
+      {"success", true},
+      {"n_embd", n_embd},
+      {"windows", ranges},
+      {"__buffers", pack_embeddings(app, embeddings, embeddings.size() / n_embd, n_embd, EMBD_FORMAT_F32)},
+  };
+}
+
+// set a linear projection applied to token-level embeddings (see action_embeddings_tokens), for example the ColBERT projection layer
+// "matrix" is row-major, "dims" rows of n_embd floats; an empty matrix removes the projection
+json action_embeddings_set_projection(app_t &app, json &body)
+{
+  std::vector<float> matrix = body["matrix"];
+  size_t dims = body.contains("dims") ? body.at("dims").get<size_t>() : 0;
+  if (!matrix.empty() && (dims == 0 || matrix.size() != dims * llama_n_embd(app.model)))
+  {
+    return json{{"error", "size of matrix must be dims x n_embd"}};
+  }
+  app.embd_projection = std::move(matrix);
+  return json{{"success", true}};
+}
+
+// get the embeddings of all tokens, requires LLAMA_POOLING_TYPE_NONE
+// each vector is projected (if "project" is set, see action_embeddings_set_projection) or truncated to "dims", then normalized
+// must be called via wllama.action_bin, output buffers: n_tokens vectors, packed in "format" (default to f32, see pack_embeddings)
+// NOTE: this clears the KV cache
+json action_embeddings_tokens(app_t &app, json &body)
+{
+  if (llama_pooling_type(app.ctx) != LLAMA_POOLING_TYPE_NONE)
+  {
+    return json{{"error", "token embeddings require pooling_type LLAMA_POOLING_TYPE_NONE"}};
+  }
+  std::vector<llama_token> tokens = body["tokens"];
+  int32_t normalize = body.contains("normalize") ? body.at("normalize").get<int32_t>() : 2;
+  embd_format format = body.contains("format") ? embd_format_from_str(body["format"]) : EMBD_FORMAT_F32;
+  bool project = body.contains("project") && body.at("project").get<bool>();
+  if (project && app.embd_projection.empty())
+  {
+    return json{{"error", "no projection is set"}};
+  }
+  const size_t n_embd = llama_n_embd(app.model);
+  const size_t n_dims = project ? app.embd_projection.size() / n_embd : get_embd_dims(app, body);
+  if (tokens.empty() || tokens.size() > llama_n_ubatch(app.ctx))
+  {
+    return json{{"error", "input must not be empty and must fit into physical batch, maybe n_ubatch is too small?"}};
+  }
+  // decode, output embeddings of all tokens
+  llama_kv_cache_clear(app.ctx);
+  app.tokens.clear();
+  common_batch_clear(app.batch);
+  for (size_t i = 0; i < tokens.size(); i++)
+  {
+    common_batch_add(app.batch, tokens[i], i, {0}, true);
+  }
+  if (llama_decode(app.ctx, app.batch) != 0)
+  {
+    llama_kv_cache_clear(app.ctx);
+    return json{{"error", "llama_decode failed, maybe n_batch is too small?"}};
+  }
+  std::vector<float> embeddings(tokens.size() * n_dims);
+  std::vector<float> projected(n_dims);
+  for (size_t i = 0; i < tokens.size(); i++)
+  {
+    const float *embd = llama_get_embeddings_ith(app.ctx, i);
+    if (embd == NULL)
+    {
+      llama_kv_cache_clear(app.ctx);
+      return json{{"error", "failed to get embeddings"}};
+    }
+    if (project)
+    {
+      for (size_t d = 0; d < n_dims; d++)
+      {
+        projected[d] = vec_dot(app.embd_projection.data() + d * n_embd, embd, n_embd);
+      }
+      embd = projected.data();
+    }
+    common_embd_normalize(embd, embeddings.data() + i * n_dims, n_dims, normalize);
+  }
+  llama_kv_cache_clear(app.ctx);
+  return json{
+      {"success", true},
+      {"n_embd", n_dims},
+      {"n_tokens", tokens.size()},
+      {"__buffers", pack_embeddings(app, embeddings, tokens.size(), n_dims, format)},
+  };
+}
+
+// score the relevance of each document to a query, using a reranker model (LLAMA_POOLING_TYPE_RANK)
+// each pair is a sequence [BOS] query [EOS] [SEP] document [EOS], pairs are scored in batches
+// output: results sorted by score (highest first), optionally only the top_n ones
+// NOTE: this clears the KV cache
+json action_rerank(app_t &app, json &body)
+{
+  if (llama_pooling_type(app.ctx) != LLAMA_POOLING_TYPE_RANK)
+  {
+    return json{{"error", "rerank requires pooling_type LLAMA_POOLING_TYPE_RANK"}};
+  }
+  std::vector<llama_token> query = body["query"];
+  std::vector<std::vector<llama_token>> documents = body["documents"];
+  size_t top_n = body.contains("top_n") ? body.at("top_n").get<size_t>() : documents.size();
+  // special tokens missing from the vocab (-1) are skipped
+  auto push_special = [](std::vector<llama_token> &pair, llama_token id)
+  {
+    if (id >= 0)
+    {
+      pair.push_back(id);
+    }
+  };
+  std::vector<std::vector<llama_token>> pairs(documents.size());
+  for (size_t i = 0; i < documents.size(); i++)
+  {
+    auto &pair = pairs[i];
+    pair.reserve(query.size() + documents[i].size() + 4);
+    push_special(pair, llama_token_bos(app.model));
+    pair.insert(pair.end(), query.begin(), query.end());
+    push_special(pair, llama_token_eos(app.model));
+    push_special(pair, llama_token_sep(app.model));
+    pair.insert(pair.end(), documents[i].begin(), documents[i].end());
+    push_special(pair, llama_token_eos(app.model));
+  }
+  std::vector<float> scores(pairs.size());
+  json res = embeddings_batch(app, pairs, 1, -1, scores.data());
+  if (res.contains("error"))
+  {
+    return res;
+  }
+  std::vector<size_t> order(pairs.size());
+  for (size_t i = 0; i < order.size(); i++)
+  {
+    order[i] = i;
+  }
+  std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b)
+                   { return scores[a] > scores[b]; });
+  json results = json::array();
+  for (size_t i = 0; i < order.size() && i < top_n; i++)
+  {
+    results.push_back(json{
+        {"index", order[i]},
+        {"score", scores[order[i]]},
+    });
+  }
+  return json{
+      {"success", true},
+      {"results", results},
+  };
+}
+
+// set the size of the embeddings cache in bytes (0 to disable it), return its current usage
+json action_embeddings_cache_config(app_t &app, json &body)
+{
+  if (body.contains("max_bytes"))
+  {
+    app.embd_cache.set_max_bytes(body.at("max_bytes").get<size_t>());
+  }
+  return json{
+      {"success", true},
+      {"n_entries", app.embd_cache.entries.size()},
+      {"n_bytes", app.embd_cache.n_bytes},
+  };
+}
+
+#define EMBD_CACHE_FILE_MAGIC 0x43454c57 // "WLEC"
+#define EMBD_CACHE_FILE_VERSION 1
+
+// save the embeddings cache to a file, together with the model fingerprint
+// format: magic, version, fingerprint, n_entries, then for each entry from least recently used: pooling, n_tokens, tokens, n_embd, embd
+json action_embeddings_cache_save(app_t &app, json &body)
+{
+  std::string path = body["path"];
+  FILE *f = fopen(path.c_str(), "wb");
+  if (f == nullptr)
+  {
+    return json{{"error", "cannot open file for writing"}};
+  }
+  uint32_t header[2] = {EMBD_CACHE_FILE_MAGIC, EMBD_CACHE_FILE_VERSION};
+  uint32_t n_entries = app.embd_cache.entries.size();
+  fwrite(header, sizeof(header), 1, f);
+  fwrite(&app.model_fingerprint, sizeof(app.model_fingerprint), 1, f);
+  fwrite(&n_entries, sizeof(n_entries), 1, f);
+  for (auto it = app.embd_cache.entries.rbegin(); it != app.embd_cache.entries.rend(); it++)
+  {
+    uint32_t n_tokens = it->tokens.size();
+    uint32_t n_embd = it->embd.size();
+    fwrite(&it->pooling, sizeof(it->pooling), 1, f);
+    fwrite(&n_tokens, sizeof(n_tokens), 1, f);
+    fwrite(it->tokens.data(), sizeof(llama_token), n_tokens, f);
+    fwrite(&n_embd, sizeof(n_embd), 1, f);
+    fwrite(it->embd.data(), sizeof(float), n_embd, f);
+  }
+  bool ok = !ferror(f);
+  fclose(f);
+  if (!ok)
+  {
+    return json{{"error", "failed to write embeddings cache"}};
+  }
+  return json{
+      {"success", true},
+      {"n_entries", n_entries},
+  };
+}
+
+// load entries from a file created by action_embeddings_cache_save, they are added to the current cache
+json action_embeddings_cache_load(app_t &app, json &body)
+{
+  std::string path = body["path"];
+  FILE *f = fopen(path.c_str(), "rb");
+  if (f == nullptr)
+  {
+    return json{{"error", "cannot open file for reading"}};
+  }
+  uint32_t header[2] = {0, 0};
+  uint64_t fingerprint = 0;
+  uint32_t n_entries = 0;
+  if (fread(header, sizeof(header), 1, f) != 1 || header[0] != EMBD_CACHE_FILE_MAGIC || header[1] != EMBD_CACHE_FILE_VERSION || fread(&fingerprint, sizeof(fingerprint), 1, f) != 1 || fread(&n_entries, sizeof(n_entries), 1, f) != 1)
+  {
+    fclose(f);
+    return json{{"error", "invalid embeddings cache file"}};
+  }
+  if (fingerprint != app.model_fingerprint)
+  {
+    fclose(f);
+    return json{{"error", "embeddings cache file was created with a different model"}};
+  }
+  int32_t pooling;
+  uint32_t n_tokens, n_embd;
+  std::vector<llama_token> tokens;
+  std::vector<float> embd;
+  for (uint32_t i = 0; i < n_entries; i++)
+  {
+    bool ok = fread(&pooling, sizeof(pooling), 1, f) == 1 && fread(&n_tokens, sizeof(n_tokens), 1, f) == 1 && n_tokens <= (1 << 24);
+    if (ok)
+    {
+      tokens.resize(n_tokens);
+      ok = fread(tokens.data(), sizeof(llama_token), n_tokens, f) == n_tokens && fread(&n_embd, sizeof(n_embd), 1, f) == 1 && n_embd == (uint32_t)get_embd_size(app);
+    }
+    if (ok)
+    {
+      embd.resize(n_embd);
+      ok = fread(embd.data(), sizeof(float), n_embd, f) == n_embd;
+    }
+    if (!ok)
+    {
+      fclose(f);
+      return json{{"error", "invalid embeddings cache file"}};
+    }
+    app.embd_cache.put(tokens, pooling, embd.data(), n_embd);
+  }
+  fclose(f);
+  return json{
+      {"success", true},
+      {"n_entries", app.embd_cache.entries.size()},
+  };
+}
+
+// create a vector index, return its handle
+// "type" is "flat" (brute-force, exact) or "hnsw" (approximate, for large collections)
+// "dims" default to n_embd
+json action_vector_index_create(app_t &app, json &body)
+{
+  std::string type = body.contains("type") ? body.at("type").get<std::string>() : "flat";
+  if (type != "flat" && type != "hnsw")
+  {
+    throw std::runtime_error("Invalid vector index type: " + type);
+  }
+  vector_index index;
+  index.type = type == "hnsw" ? vector_index::HNSW : vector_index::FLAT;
+  index.n_dims = body.contains("dims") ? body.at("dims").get<uint32_t>() : 0;
+  if (index.n_dims == 0)
+  {
+    if (app.model == nullptr)
+    {
+      return json{{"error", "dims must be specified if no model is loaded"}};
+    }
+    index.n_dims = llama_n_embd(app.model);
+  }
+  if (body.contains("m"))
+    index.M = std::max(body.at("m").get<uint32_t>(), 2u);
+  if (body.contains("ef_construction"))
+    index.ef_construction = std::max(body.at("ef_construction").get<uint32_t>(), 1u);
+  int32_t handle = app.vector_index_next_handle++;
+  app.vector_indexes[handle] = std::move(index);
+  return json{
+      {"success", true},
+      {"handle", handle},
+  };
+}
+
+// get the normalized vectors of a vector_index_add or vector_index_search request, either from:
+// - "inputs": lists of tokens, embeddings are computed then added without leaving the engine
+// - "vectors": flat array of n_vectors x dims floats
+static json get_index_vectors(app_t &app, json &body, uint32_t n_dims, std::vector<float> &out)
+{
+  if (body.contains("inputs"))
+  {
+    std::vector<std::vector<llama_token>> inputs = body["inputs"];
+    if (app.model == nullptr)
+    {
+      return json{{"error", "inputs can only be used if a model is loaded, use vectors instead"}};
+    }
+    if (n_dims > (uint32_t)llama_n_embd(app.model))
+    {
+      return json{{"error", "dims of the index is larger than n_embd of the model"}};
+    }
+    out.resize(inputs.size() * n_dims);
+    return embeddings_batch(app, inputs, n_dims, 2, out.data());
+  }
+  std::vector<float> vectors = body["vectors"];
+  if (vectors.size() % n_dims != 0)
+  {
+    return json{{"error", "size of vectors must be a multiple of dims"}};
+  }
+  out.resize(vectors.size());
+  for (size_t i = 0; i < vectors.size(); i += n_dims)
+  {
+    common_embd_normalize(vectors.data() + i, out.data() + i, n_dims, 2);
+  }
+  return json{{"success", true}};
+}
+
+// add vectors to an index, an existing id is replaced
+// NOTE: if "inputs" is used, this clears the KV cache
+json action_vector_index_add(app_t &app, json &body)
+{
+  auto it = app.vector_indexes.find(body["handle"]);
+  if (it == app.vector_indexes.end())
+  {
+    return json{{"error", "invalid vector index handle"}};
+  }
+  vector_index &index = it->second;
+  std::vector<int64_t> ids = body["ids"];
+  std::vector<float> vectors;
+  json res = get_index_vectors(app, body, index.n_dims, vectors);
+  if (res.contains("error"))
+  {
+    return res;
+  }
+  if (vectors.size() != ids.size() * index.n_dims)
+  {
+    return json{{"error", "number of ids does not match number of vectors"}};
+  }
+  for (size_t i = 0; i < ids.size(); i++)
+  {
+    index.add(ids[i], vectors.data() + i * index.n_dims);
+  }
+  return json{
+      {"success", true},
+      {"n_vectors", index.n_alive},
+  };
+}
+
+// find the k most similar vectors to each query, given by "inputs" or "vectors" (see get_index_vectors)
+// "ef" is the size of the candidate list for hnsw, larger is more accurate but slower
+json action_vector_index_search(app_t &app, json &body)
+{
+  auto it = app.vector_indexes.find(body["handle"]);
+  if (it == app.vector_indexes.end())
+  {
+    return json{{"error", "invalid vector index handle"}};
+  }
+  vector_index &index = it->second;
+  int64_t k = body.contains("k") ? body.at("k").get<int64_t>() : 10;
+  size_t ef = body.contains("ef") ? body.at("ef").get<size_t>() : 64;
+  if (k < 1)
+  {
+    return json{{"error", "k must be at least 1"}};
+  }
+  std::vector<float> queries;
+  json res = get_index_vectors(app, body, index.n_dims, queries);
+  if (res.contains("error"))
+  {
+    return res;
+  }
+  json results = json::array();
+  for (size_t i = 0; i < queries.size(); i += index.n_dims)
+  {
+    std::vector<int64_t> ids;
+    std::vector<float> scores;
+    for (auto &r : index.search(queries.data() + i, k, ef))
+    {
+      scores.push_back(r.first);
+      ids.push_back(r.second);
+    }
+    results.push_back(json{
+        {"ids", ids},
+        {"scores", scores},
+    });
+  }
+  return json{
+      {"success", true},
+      {"results", results},
+  };
+}
+
+// remove vectors from an index by their ids
+json action_vector_index_remove(app_t &app, json &body)
+{
+  auto it = app.vector_indexes.find(body["handle"]);
+  if (it == app.vector_indexes.end())
+  {
+    return json{{"error", "invalid vector index handle"}};
+  }
+  std::vector<int64_t> ids = body["ids"];
+  size_t n_removed = 0;
+  for (auto id : ids)
+  {
+    n_removed += it->second.remove(id);
+  }
+  return json{
+      {"success", true},
+      {"n_removed", n_removed},
+      {"n_vectors", it->second.n_alive},
+  };
+}
+
+// save an index to a file
+json action_vector_index_save(app_t &app, json &body)
+{
+  auto it = app.vector_indexes.find(body["handle"]);
+  if (it == app.vector_indexes.end())
+  {
+    return json{{"error", "invalid vector index handle"}};
+  }
+  std::string path = body["path"];
+  FILE *f = fopen(path.c_str(), "wb");
+  if (f == nullptr)
+  {
+    return json{{"error", "cannot open file for writing"}};
+  }
+  bool ok = it->second.save(f);
+  fclose(f);
+  if (!ok)
+  {
+    return json{{"error", "failed to write vector index"}};
+  }
+  return json{{"success", true}};
+}
+
+// load an index from a file created by action_vector_index_save, return its handle
+json action_vector_index_load(app_t &app, json &body)
+{
+  std::string path = body["path"];
+  FILE *f = fopen(path.c_str(), "rb");
+  if (f == nullptr)
+  {
+    return json{{"error", "cannot open file for reading"}};
+  }
+  vector_index index;
+  bool ok = index.load(f);
+  fclose(f);
+  if (!ok)
+  {
+    return json{{"error", "invalid vector index file"}};
+  }
+  int32_t handle = app.vector_index_next_handle++;
+  app.vector_indexes[handle] = std::move(index);
+  return json{
+      {"success", true},
+      {"handle", handle},
+      {"dims", app.vector_indexes[handle].n_dims},
+      {"n_vectors", app.vector_indexes[handle].n_alive},
+  };
+}
+
+// free an index
+json action_vector_index_free(app_t &app, json &body)
+{
+  auto it = app.vector_indexes.find(body["handle"]);
+  if (it == app.vector_indexes.end())
+  {
+    return json{{"error", "invalid vector index handle"}};
+  }
+  app.vector_indexes.erase(it);
+  return json{{"success", true}};
+}
+
+// apply chat template
+json action_chat_format(app_t &app, json &body)
+{
+  std::string tmpl = body.contains("tmpl") ? body["tmpl"] : "";
+  bool add_ass = body.contains("add_ass") ? body.at("add_ass").get<bool>() : false;
+  if (!body.contains("messages"))
+  {
+    return json{{"error", "messages is required"}};
+  }
+  std::vector<common_chat_msg> chat;
+  for (auto &item : body["messages"])
+  {
+    chat.push_back({item["role"], item["content"]});
+  }
+  try
+  {
+    std::string formatted_chat = common_chat_apply_template(app.model, tmpl, chat, add_ass);
+    return json{
+        {"success", true},
+        {"formatted_chat", formatted_chat},
+    };
+  }
+  catch (const std::exception &e)
+  {
+    return json{{"error", e.what()}};
+  }
+}
+
+// remove tokens in kv, for context-shifting
+json action_kv_remove(app_t &app, json &body)
+{
+  const int n_keep = body["n_keep"];
+  const int n_discard = body["n_discard"];
+  const int n_past = app.tokens.size();
+  llama_kv_cache_seq_rm(app.ctx, 0, n_keep, n_keep + n_discard);
+  llama_kv_cache_seq_add(app.ctx, 0, n_keep + n_discard, n_past, -n_discard);
+  app.tokens.erase(
+      app.tokens.begin() + n_keep,
+      app.tokens.begin() + n_keep + n_discard);
+  return json{
+      {"success", true},
+      {"n_past", app.tokens.size()},
+  };
+}
+
+// clear all tokens in kv
+json action_kv_clear(app_t &app, json &body)
+{
+  llama_kv_cache_clear(app.ctx);
+  app.tokens.clear();
+  return json{
+      {"success", true},
+      {"n_past", app.tokens.size()},
+  };
+}
+
+// allocate the buffer receiving the inputs of wllama.action_bin, the worker copies them into the returned region
+json action_alloc_in_buf(app_t &app, json &body)
+{
+  size_t size = body["size"];
+  app.in_buf.resize(size);
+  return json{
+      {"success", true},
+      {"region", heap_region(app.in_buf.data(), size)},
+  };
+}
+
+// get the input buffers copied by the worker, see action_alloc_in_buf
+static std::vector<std::string_view> get_in_buffers(app_t &app, json &body)
+{
+  std::vector<std::string_view> output;
+  if (!body.contains("__in_buffers"))
+  {
+    return output;
+  }
+  for (auto &region : body["__in_buffers"])
+  {
+    size_t offset = region[0];
+    size_t size = region[1];
+    if (offset + size > app.in_buf.size())
+    {
+      throw std::runtime_error("invalid input buffer");
+    }
+    output.emplace_back(app.in_buf.data() + offset, size);
+  }
+  return output;
+}
+
+// serialize the state of positions [p0, p1) of seq 0 (p1 = -1 for all)
+// if scratch_seq > 0, the cells are shared with it (no copy) and it is serialized alone, so that the cost is proportional to the range;
+// otherwise the whole seq 0 is serialized
+static bool kv_get_range(app_t &app, llama_seq_id scratch_seq, llama_pos p0, llama_pos p1, std::vector<uint8_t> &out)
+{
+  llama_seq_id seq = 0;
+  if (scratch_seq > 0)
+  {
+    llama_kv_cache_seq_rm(app.ctx, scratch_seq, -1, -1);
+    llama_kv_cache_seq_cp(app.ctx, 0, scratch_seq, p0, p1);
+    seq = scratch_seq;
+  }
+  out.resize(llama_state_seq_get_size(app.ctx, seq));
+  size_t n_written = llama_state_seq_get_data(app.ctx, out.data(), out.size(), seq);
+  if (seq != 0)
+  {
+    llama_kv_cache_seq_rm(app.ctx, seq, -1, -1);
+  }
+  out.resize(n_written);
+  return n_written > 0;
+}
+
+// destination of write_session: a file, or a memory buffer if f is nullptr
+struct session_writer
+{
+  FILE *f = nullptr;
+  std::vector<char> *buf = nullptr;
+
+  void write(const void *data, size_t n)
+  {
+    if (f != nullptr)
+      fwrite(data, 1, n, f);
+    else
+      buf->insert(buf->end(), (const char *)data, (const char *)data + n);
+  }
+
+  void rewrite_header(const session_file_header &header)
+  {
+    if (f != nullptr)
+    {
+      fseek(f, 0, SEEK_SET);
+      fwrite(&header, sizeof(header), 1, f);
+    }
+    else
+      memcpy(buf->data(), &header, sizeof(header));
+  }
+};
+
+// write the KV cache of seq 0 and the current tokens in the session file format
+// "compress" (default to true): compress the state; blocks which do not shrink are stored as-is
+// "chunk_size": approximate size in bytes of the chunks, which bounds the memory needed to save and load the session;
+// it needs n_seq_max >= 2 (the last sequence is used as scratch), otherwise the state is written as a single chunk
+// "n_tokens": only write this many tokens from the start; needs n_seq_max >= 2 if fewer than all tokens
+static json write_session(app_t &app, json &body, session_writer &out, session_file_header &header)
+{
+  bool compress = body.contains("compress") ? body["compress"].get<bool>() : true;
+  size_t chunk_size = body.contains("chunk_size") ? body["chunk_size"].get<size_t>() : SESSION_CHUNK_SIZE;
+  chunk_size = std::min<size_t>(chunk_size, SESSION_MAX_CHUNK_SIZE / 2); // chunks are split by estimated size, leave some margin
+  const llama_seq_id scratch_seq = llama_n_seq_max(app.ctx) - 1;
+  size_t n_tokens = app.tokens.size();
+  if (body.contains("n_tokens"))
+  {
+    n_tokens = std::min(n_tokens, body["n_tokens"].get<size_t>());
+  }
+  if (n_tokens < app.tokens.size() && scratch_seq < 1)
+  {
+    return json{{"error", "exporting part of the tokens requires n_seq_max >= 2"}};
+  }
+  size_t tokens_per_chunk = n_tokens;
+  if (scratch_seq > 0 && n_tokens > 0)
+  {
+    size_t total_size = llama_state_seq_get_size(app.ctx, 0);
+    tokens_per_chunk = std::max<size_t>(1, (double)chunk_size * n_tokens / std::max<size_t>(total_size, 1));
+  }
+  header = {
+      SESSION_FILE_MAGIC,
+      SESSION_FILE_VERSION,
+      app.model_fingerprint,
+      app.cparams_fingerprint,
+      (int32_t)app.cache_type_k,
+      (int32_t)app.cache_type_v,
+      (uint32_t)n_tokens,
+      0,
+      0,
+  };
+  out.write(&header, sizeof(header)); // rewritten at the end
+  out.write(app.tokens.data(), n_tokens * sizeof(llama_token));
+  std::vector<uint8_t> chunk;
+  std::vector<uint8_t> block;
+  size_t p0 = 0;
+  do
+  {
+    size_t p1 = std::min(n_tokens, p0 + tokens_per_chunk);
+    if (!kv_get_range(app, p1 < app.tokens.size() || p0 > 0 ? scratch_seq : 0, p0, p1, chunk))
+    {
+      return json{{"error", "llama_state_seq_get_data failed"}};
+    }
+    if (chunk.size() > SESSION_MAX_CHUNK_SIZE)
+    {
+      return json{{"error", "KV cache is too large for a single session chunk, n_seq_max must be at least 2"}};
+    }
+    uint64_t size = chunk.size();
+    out.write(&size, sizeof(size));
+    for (size_t offset = 0; offset < chunk.size(); offset += SESSION_BLOCK_SIZE)
+    {
+      const uint8_t *raw = chunk.data() + offset;
+      uint32_t sizes[2] = {(uint32_t)std::min<size_t>(SESSION_BLOCK_SIZE, chunk.size() - offset), 0};
+      block.clear();
+      if (compress)
+      {
+        lz_compress(raw, sizes[0], block);
+      }
+      bool is_stored = !compress || block.size() >= sizes[0];
+      sizes[1] = is_stored ? sizes[0] : block.size();
+      out.write(sizes, sizeof(sizes));
+      out.write(is_stored ? raw : block.data(), sizes[1]);
+    }
+    header.n_chunks++;
+    header.state_size += size;
+    p0 = p1;
+  } while (p0 < n_tokens);
+  out.rewrite_header(header);
+  return json{{"success", true}};
 }
 
-// save current session
+// save the current session to a file, see write_session
 json action_session_save(app_t &app, json &body)
 {
   std::string session_path = body["session_path"];
-  std::vector<llama_token> dummy;
-  if (!llama_state_seq_save_file(
-          app.ctx,
-          session_path.c_str(),
-          0,            // seq_id
-          dummy.data(), // tokens
-          dummy.size()  // n_token_count
-          ))
+  FILE *f = fopen(session_path.c_str(), "wb");
+  if (f == nullptr)
   {
-    return json{{"error", "action_session_save failed"}};
+    return json{{"error", "cannot open file for writing"}};
+  }
+  session_writer out;
+  out.f = f;
+  session_file_header header;
+  json result = write_session(app, body, out, header);
+  fseek(f, 0, SEEK_END);
+  size_t n_bytes = ftell(f);
+  bool ok = !ferror(f);
+  fclose(f);
+  if (result.contains("error"))
+  {
+    return result;
+  }
+  if (!ok)
+  {
+    return json{{"error", "failed to write session file"}};
   }
   return json{
       {"success", true},
-      {"tokens", app.tokens},
+      {"tokens", std::vector<llama_token>(app.tokens.begin(), app.tokens.begin() + header.n_tokens)},
+      {"n_bytes", n_bytes},
+      {"n_chunks", header.n_chunks},
+      {"state_size", header.state_size},
+  };
+}
+
+// same as action_session_save, but the content is returned as a binary buffer
+json action_session_export(app_t &app, json &body)
+{
+  app.out_buf.clear();
+  session_writer out;
+  out.buf = &app.out_buf;
+  session_file_header header;
+  json result = write_session(app, body, out, header);
+  if (result.contains("error"))
+  {
+    return result;
+  }
+  return json{
+      {"success", true},
+      {"tokens", std::vector<llama_token>(app.tokens.begin(), app.tokens.begin() + header.n_tokens)},
+      {"n_chunks", header.n_chunks},
+      {"state_size", header.state_size},
+      {"__buffers", json::array({heap_region(app.out_buf.data(), app.out_buf.size())})},
+  };
+}
+
+// consume the bytes in reader.pending, once reader.need of them are available
+static bool session_reader_step(app_t &app, session_reader_t &r)
+{
+  const llama_seq_id scratch_seq = llama_n_seq_max(app.ctx) - 1;
+  auto fail = [&](const char *msg)
+  {
+    r.error = msg;
+    return false;
   };
+  switch (r.stage)
+  {
+  case session_reader_t::HEADER:
+  {
+    // everything is validated before touching the KV cache
+    auto &h = r.header;
+    memcpy(&h, r.pending.data(), sizeof(h));
+    if (h.magic != SESSION_FILE_MAGIC || h.version != SESSION_FILE_VERSION || h.n_chunks == 0)
+      return fail("invalid session file");
+    if (h.model_fingerprint != app.model_fingerprint)
+      return fail("session file was created with a different model");
+    if (h.cparams_fingerprint != app.cparams_fingerprint || h.type_k != (int32_t)app.cache_type_k || h.type_v != (int32_t)app.cache_type_v)
+      return fail("session file was created with a different KV cache type or RoPE params");
+    if (h.n_tokens > llama_n_ctx(app.ctx))
+      return fail("session file has more tokens than n_ctx");
+    if (h.n_chunks > 1 && scratch_seq < 1)
+      return fail("session file has several chunks, n_seq_max must be at least 2 to load it");
+    llama_kv_cache_seq_rm(app.ctx, 0, -1, -1);
+    app.tokens.clear();
+    r.stage = session_reader_t::TOKENS;
+    r.need = h.n_tokens * sizeof(llama_token);
+    break;
+  }
+  case session_reader_t::TOKENS:
+    r.tokens.resize(r.header.n_tokens);
+    memcpy(r.tokens.data(), r.pending.data(), r.need);
+    r.stage = session_reader_t::CHUNK;
+    r.need = sizeof(uint64_t);
+    break;
+  case session_reader_t::CHUNK:
+  {
+    uint64_t size;
+    memcpy(&size, r.pending.data(), sizeof(size));
+    if (size == 0 || size > r.header.state_size - r.state_read || size > SESSION_MAX_CHUNK_SIZE)
+      return fail("invalid session file");
+    r.chunk.clear();
+    r.chunk_size = size;
+    r.chunk_offset = 0;
+    r.state_read += size;
+    r.stage = session_reader_t::BLOCK;
+    r.need = sizeof(r.block_sizes);
+    break;
+  }
+  case session_reader_t::BLOCK:
+    memcpy(r.block_sizes, r.pending.data(), sizeof(r.block_sizes));
+    if (r.block_sizes[0] == 0 || r.block_sizes[0] > SESSION_BLOCK_SIZE || r.block_sizes[0] > r.chunk_size - r.chunk_offset || r.block_sizes[1] > r.block_sizes[0])
+      return fail("invalid session file");
+    r.stage = session_reader_t::BLOCK_DATA;
+    r.need = r.block_sizes[1];
+    break;
+  case session_reader_t::BLOCK_DATA:
+  {
+    r.chunk.resize(r.chunk_offset + r.block_sizes[0]);
+    uint8_t *dst = r.chunk.data() + r.chunk_offset;
+    if (r.block_sizes[1] == r.block_sizes[0])
+      memcpy(dst, r.pending.data(), r.block_sizes[0]);
+    else if (!lz_decompress(r.pending.data(), r.block_sizes[1], dst, r.block_sizes[0]))
+      return fail("invalid session file");
+    r.chunk_offset += r.block_sizes[0];
+    r.stage = session_reader_t::BLOCK;
+    r.need = sizeof(r.block_sizes);
+    if (r.chunk_offset < r.chunk_size)
+      break;
+    // the chunk is complete: llama_state_seq_set_data replaces the whole destination sequence,
+    // so chunks after the first one go through the scratch sequence
+    llama_seq_id dest = r.chunk_index == 0 ? 0 : scratch_seq;
+    if (llama_state_seq_set_data(app.ctx, r.chunk.data(), r.chunk.size(), dest) == 0)
+      return fail("llama_state_seq_set_data failed");
+    if (dest != 0)
+    {
+      llama_kv_cache_seq_cp(app.ctx, dest, 0, -1, -1);
+      llama_kv_cache_seq_rm(app.ctx, dest, -1, -1);
+    }
+    r.chunk_index++;
+    r.stage = session_reader_t::CHUNK;
+    r.need = sizeof(uint64_t);
+    if (r.chunk_index == r.header.n_chunks)
+    {
+      app.tokens = r.tokens;
+      r.stage = session_reader_t::DONE;
+      r.need = 0;
+      std::vector<uint8_t>().swap(r.chunk);
+    }
+    break;
+  }
+  case session_reader_t::DONE:
+    break;
+  }
+  r.pending.clear();
+  return true;
+}
+
+// feed a piece of a session file to the reader, return false on error (see reader.error), in which case seq 0 is cleared
+// clear the partially restored state, seq 0 and the scratch sequence are left empty
+static void session_reader_abort(app_t &app, session_reader_t &r)
+{
+  llama_kv_cache_seq_rm(app.ctx, 0, -1, -1);
+  llama_kv_cache_seq_rm(app.ctx, llama_n_seq_max(app.ctx) - 1, -1, -1);
+  app.tokens.clear();
+  r.stage = session_reader_t::DONE;
+  std::vector<uint8_t>().swap(r.chunk);
+  std::vector<uint8_t>().swap(r.pending);
+}
+
+static bool session_reader_feed(app_t &app, session_reader_t &r, const uint8_t *data, size_t n)
+{
+  try
+  {
+    while (true)
+    {
+      while (r.stage != session_reader_t::DONE && r.pending.size() == r.need)
+      {
+        if (!session_reader_step(app, r))
+        {
+          session_reader_abort(app, r);
+          return false;
+        }
+      }
+      if (n == 0 || r.stage == session_reader_t::DONE)
+      {
+        return true;
+      }
+      size_t take = std::min(n, r.need - r.pending.size());
+      r.pending.insert(r.pending.end(), data, data + take);
+      data += take;
+      n -= take;
+    }
+  }
+  catch (const std::exception &e)
+  {
+    // for example, out of memory while growing a chunk
+    r.error = std::string("cannot load session: ") + e.what();
+    session_reader_abort(app, r);
+    return false;
+  }
 }
 
-// load a session from disk
+// load a session file created by action_session_save into seq 0, replacing its current content
+// the header is checked against the loaded model and context params before touching the KV cache;
+// the file is read in pieces of SESSION_READ_SIZE bytes, and only one chunk of the state is held in memory at a time
 json action_session_load(app_t &app, json &body)
 {
   std::string session_path = body["session_path"];
-  std::vector<llama_token> saved_tokens = body["tokens"];
-  auto n_ctx = llama_n_ctx(app.ctx);
-  size_t n_token_count_out = 0;
-  std::vector<llama_token> dummy;
-  if (!llama_state_seq_load_file(
-          app.ctx,
-          session_path.c_str(),
-          0,                 // dest_seq_id
-          dummy.data(),      // tokens_out
-          dummy.capacity(),  // n_token_capacity
-          &n_token_count_out // n_token_count_out
-          ))
-  {
-    return json{{"error", "llama_load_session_file failed"}};
-  }
-  // load tokens
-  app.tokens.clear();
-  app.tokens.reserve(saved_tokens.size());
-  for (auto id : saved_tokens)
+  FILE *f = fopen(session_path.c_str(), "rb");
+  if (f == nullptr)
   {
-    app.tokens.push_back(id);
+    return json{{"error", "cannot open file for reading"}};
+  }
+  session_reader_t reader;
+  std::vector<uint8_t> buf(SESSION_READ_SIZE);
+  bool ok = true;
+  while (ok && reader.stage != session_reader_t::DONE)
+  {
+    size_t n = fread(buf.data(), 1, buf.size(), f);
+    if (n == 0)
+    {
+      break;
+    }
+    ok = session_reader_feed(app, reader, buf.data(), n);
+  }
+  fclose(f);
+  if (!ok)
+  {
+    return json{{"error", reader.error}};
+  }
+  if (reader.stage != session_reader_t::DONE)
+  {
+    session_reader_abort(app, reader);
+    return json{{"error", "session file is truncated"}};
+  }
+  return json{
+      {"success", true},
+      {"n_past", app.tokens.size()},
+  };
+}
+
+// start loading a session whose content is provided by session_load_feed, for example from a stream on the JS side
+json action_session_load_begin(app_t &app, json &)
+{
+  if (app.session_reader && app.session_reader->stage != session_reader_t::DONE)
+  {
+    // a previous load was not finished, do not leave it half restored
+    session_reader_abort(app, *app.session_reader);
+  }
+  app.session_reader.reset(new session_reader_t());
+  return json{{"success", true}};
+}
+
+// feed the next pieces of the session file, passed as input buffers; "final" must be set with the last piece
+json action_session_load_feed(app_t &app, json &body)
+{
+  if (!app.session_reader)
+  {
+    return json{{"error", "session_load_begin must be called first"}};
+  }
+  auto &reader = *app.session_reader;
+  bool final = body.contains("final") && body.at("final").get<bool>();
+  bool ok = true;
+  for (auto &input : get_in_buffers(app, body))
+  {
+    ok = ok && session_reader_feed(app, reader, (const uint8_t *)input.data(), input.size());
+  }
+  if (!ok)
+  {
+    std::string error = reader.error;
+    app.session_reader.reset();
+    return json{{"error", error}};
+  }
+  bool done = reader.stage == session_reader_t::DONE;
+  if (final)
+  {
+    // also used to cancel a load, for example when the source stream fails
+    if (!done)
+    {
+      session_reader_abort(app, reader);
+    }
+    app.session_reader.reset();
+    if (!done)
+    {
+      return json{{"error", "session data is truncated"}};
+    }
+  }
+  return json{
+      {"success", true},
+      {"done", done},
+      {"n_past", app.tokens.size()},
+  };
+}
+
+// save the KV cache of seq 0 and the current tokens into a named in-memory snapshot
+json action_kv_snapshot_save(app_t &app, json &body)
+{
+  std::string name = body["name"];
+  size_t size = llama_state_seq_get_size(app.ctx, 0);
+  std::vector<uint8_t> data = app.kv_snapshots.take_buffer(size);
+  size_t n_written = llama_state_seq_get_data(app.ctx, data.data(), data.size(), 0);
+  if (n_written == 0)
+  {
+    // the previous snapshot with this name, if any, is kept
+    app.kv_snapshots.release_buffer(std::move(data));
+    return json{{"error", "llama_state_seq_get_data failed"}};
+  }
+  data.resize(n_written);
+  app.kv_snapshots.put(name, std::move(data), app.tokens);
+  return json{
+      {"success", true},
+      {"n_bytes", n_written},
+      {"n_tokens", app.tokens.size()},
+  };
+}
+
+// restore a snapshot into seq 0, replacing its current content
+json action_kv_snapshot_load(app_t &app, json &body)
+{
+  std::string name = body["name"];
+  auto *entry = app.kv_snapshots.get(name);
+  if (entry == nullptr)
+  {
+    return json{{"error", "snapshot not found: " + name}};
+  }
+  llama_kv_cache_seq_rm(app.ctx, 0, -1, -1);
+  if (llama_state_seq_set_data(app.ctx, entry->data.data(), entry->data.size(), 0) == 0)
+  {
+    app.tokens.clear();
+    return json{{"error", "llama_state_seq_set_data failed"}};
+  }
+  app.tokens = entry->tokens;
+  return json{
+      {"success", true},
+      {"n_past", app.tokens.size()},
+  };
+}
+
+json action_kv_snapshot_delete(app_t &app, json &body)
+{
+  std::string name = body["name"];
+  return json{
+      {"success", true},
+      {"deleted", app.kv_snapshots.remove(name)},
+  };
+}
+
+// set the memory budget of the snapshots (if max_bytes is given) and list them, most recently used first
+json action_kv_snapshot_config(app_t &app, json &body)
+{
+  auto &store = app.kv_snapshots;
+  if (body.contains("max_bytes"))
+  {
+    store.set_max_bytes(body["max_bytes"]);
+  }
+  json names = json::array();
+  for (auto &e : store.entries)
+  {
+    names.push_back(e.name);
+  }
+  return json{
+      {"success", true},
+      {"max_bytes", store.max_bytes},
+      {"n_bytes", store.n_bytes},
+      {"names", names},
+  };
+}
+
+// copy out a snapshot, so that it can be persisted by the caller
+json action_kv_snapshot_export(app_t &app, json &body)
+{
+  std::string name = body["name"];
+  auto *entry = app.kv_snapshots.get(name);
+  if (entry == nullptr)
+  {
+    return json{{"error", "snapshot not found: " + name}};
+  }
+  return json{
+      {"success", true},
+      {"tokens", entry->tokens},
+      {"__buffers", json::array({heap_region(entry->data.data(), entry->data.size())})},
+  };
+}
+
+// add a snapshot previously exported, the data is passed as the first input buffer
+json action_kv_snapshot_import(app_t &app, json &body)
+{
+  std::string name = body["name"];
+  std::vector<llama_token> tokens = body["tokens"];
+  auto inputs = get_in_buffers(app, body);
+  if (inputs.empty() || inputs[0].empty())
+  {
+    return json{{"error", "missing snapshot data"}};
   }
+  std::vector<uint8_t> data = app.kv_snapshots.take_buffer(inputs[0].size());
+  std::copy(inputs[0].begin(), inputs[0].end(), data.begin());
+  app.kv_snapshots.put(name, std::move(data), tokens);
   return json{{"success", true}};
 }
 
+// save an incremental checkpoint: if the current tokens extend the ones of the previous checkpoint with the same name,
+// only the cells of the new positions are saved; otherwise, or once the chain has max_parts parts, it is compacted into a single full part
+// the last sequence (n_seq_max - 1) is used as scratch, it must not be in use
+json action_kv_checkpoint_save(app_t &app, json &body)
+{
+  std::string name = body["name"];
+  size_t max_parts = body.contains("max_parts") ? body["max_parts"].get<size_t>() : 8;
+  const llama_seq_id scratch_seq = llama_n_seq_max(app.ctx) - 1;
+  if (scratch_seq < 1)
+  {
+    return json{{"error", "n_seq_max is too small, it must be at least 2"}};
+  }
+  auto &ckpt = app.kv_checkpoints[name];
+  size_t n_prev = ckpt.tokens.size();
+  bool is_append = n_prev > 0 && n_prev <= app.tokens.size() && std::equal(ckpt.tokens.begin(), ckpt.tokens.end(), app.tokens.begin()) && ckpt.parts.size() < max_parts;
+  if (is_append && n_prev == app.tokens.size())
+  {
+    // nothing new
+    return json{
+        {"success", true},
+        {"n_bytes_written", 0},
+        {"n_bytes", ckpt.get_n_bytes()},
+        {"n_parts", ckpt.parts.size()},
+        {"compacted", false},
+    };
+  }
+  std::vector<uint8_t> part;
+  if (!kv_get_range(app, is_append ? scratch_seq : 0, is_append ? n_prev : 0, -1, part))
+  {
+    // an existing checkpoint is left as it was, only the entry created above is removed
+    if (n_prev == 0)
+    {
+      app.kv_checkpoints.erase(name);
+    }
+    return json{{"error", "llama_state_seq_get_data failed"}};
+  }
+  size_t n_written = part.size();
+  if (!is_append)
+  {
+    ckpt.parts.clear();
+    ckpt.part_end.clear();
+  }
+  ckpt.parts.push_back(std::move(part));
+  ckpt.part_end.push_back(app.tokens.size());
+  ckpt.tokens = app.tokens;
+  return json{
+      {"success", true},
+      {"n_bytes_written", n_written},
+      {"n_bytes", ckpt.get_n_bytes()},
+      {"n_parts", ckpt.parts.size()},
+      {"compacted", !is_append && n_prev > 0},
+  };
+}
+
+// restore a checkpoint chain into seq 0, replacing its current content
+json action_kv_checkpoint_load(app_t &app, json &body)
+{
+  std::string name = body["name"];
+  auto it = app.kv_checkpoints.find(name);
+  if (it == app.kv_checkpoints.end())
+  {
+    return json{{"error", "checkpoint not found: " + name}};
+  }
+  auto &ckpt = it->second;
+  const llama_seq_id scratch_seq = llama_n_seq_max(app.ctx) - 1;
+  if (ckpt.parts.size() > 1 && scratch_seq < 1)
+  {
+    return json{{"error", "n_seq_max is too small, it must be at least 2"}};
+  }
+  app.tokens.clear();
+  llama_kv_cache_seq_rm(app.ctx, 0, -1, -1);
+  for (size_t i = 0; i < ckpt.parts.size(); i++)
+  {
+    // llama_state_seq_set_data replaces the whole destination sequence, so parts after the first one go through the scratch sequence
+    auto &part = ckpt.parts[i];
+    llama_seq_id dest = i == 0 ? 0 : scratch_seq;
+    if (llama_state_seq_set_data(app.ctx, part.data(), part.size(), dest) == 0)
+    {
+      llama_kv_cache_seq_rm(app.ctx, 0, -1, -1);
+      llama_kv_cache_seq_rm(app.ctx, scratch_seq, -1, -1);
+      return json{{"error", "llama_state_seq_set_data failed"}};
+    }
+    if (dest != 0)
+    {
+      llama_kv_cache_seq_cp(app.ctx, dest, 0, -1, -1);
+      llama_kv_cache_seq_rm(app.ctx, dest, -1, -1);
+    }
+  }
+  app.tokens = ckpt.tokens;
+  return json{
+      {"success", true},
+      {"n_past", app.tokens.size()},
+  };
+}
+
+json action_kv_checkpoint_delete(app_t &app, json &body)
+{
+  std::string name = body["name"];
+  return json{
+      {"success", true},
+      {"deleted", app.kv_checkpoints.erase(name) > 0},
+  };
+}
+
 // get the current status
 json action_current_status(app_t &app, json &body)
 {
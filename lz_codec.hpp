@@ -0,0 +1,155 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
+#include <cstddef>
+
+// fast LZ77 codec, using the LZ4 block format:
+// each sequence is a token (4 bits literal length, 4 bits match length - 4), the literals, a 2-byte offset and the match length
+// lengths >= 15 continue in the following bytes (255 means "more"); the last sequence only has literals
+
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 16
+#define LZ_MAX_OFFSET 65535
+#define LZ_LAST_LITERALS 5 // the last bytes are always literals
+#define LZ_MATCH_LIMIT 12  // no match starts in the last bytes
+
+inline static void lz_write_len(std::vector<uint8_t> &dst, size_t len)
+{
+  for (; len >= 255; len -= 255)
+  {
+    dst.push_back(255);
+  }
+  dst.push_back((uint8_t)len);
+}
+
+// match_len = 0 for the last sequence
+inline static void lz_write_sequence(std::vector<uint8_t> &dst, const uint8_t *lit, size_t n_lit, size_t offset, size_t match_len)
+{
+  size_t ml = match_len > 0 ? match_len - LZ_MIN_MATCH : 0;
+  dst.push_back((uint8_t)((std::min<size_t>(n_lit, 15) << 4) | std::min<size_t>(ml, 15)));
+  if (n_lit >= 15)
+  {
+    lz_write_len(dst, n_lit - 15);
+  }
+  dst.insert(dst.end(), lit, lit + n_lit);
+  if (match_len == 0)
+  {
+    return;
+  }
+  dst.push_back((uint8_t)(offset & 0xff));
+  dst.push_back((uint8_t)(offset >> 8));
+  if (ml >= 15)
+  {
+    lz_write_len(dst, ml - 15);
+  }
+}
+
+// compress n bytes (n < 4GB) and append the result to dst
+inline static void lz_compress(const uint8_t *src, size_t n, std::vector<uint8_t> &dst)
+{
+  std::vector<uint32_t> table(1 << LZ_HASH_BITS, 0); // position + 1 of the last occurrence of each hash
+  size_t anchor = 0;                                  // start of the pending literals
+  size_t i = 0;
+  const size_t limit = n > LZ_MATCH_LIMIT ? n - LZ_MATCH_LIMIT : 0;
+  while (i < limit)
+  {
+    uint32_t seq;
+    memcpy(&seq, src + i, sizeof(seq));
+    uint32_t h = (seq * 2654435761U) >> (32 - LZ_HASH_BITS);
+    size_t ref = table[h];
+    table[h] = (uint32_t)(i + 1);
+    if (ref == 0 || i + 1 - ref > LZ_MAX_OFFSET || memcmp(src + ref - 1, src + i, LZ_MIN_MATCH) != 0)
+    {
+      // skip faster over data which does not compress
+      i += 1 + ((i - anchor) >> 6);
+      continue;
+    }
+    ref -= 1;
+    size_t len = LZ_MIN_MATCH;
+    const size_t max_len = n - LZ_LAST_LITERALS - i;
+    while (len < max_len && src[ref + len] == src[i + len])
+    {
+      len++;
+    }
+    lz_write_sequence(dst, src + anchor, i - anchor, i - ref, len);
+    i += len;
+    anchor = i;
+  }
+  lz_write_sequence(dst, src + anchor, n - anchor, 0, 0);
+}
+
+inline static bool lz_read_len(const uint8_t *src, size_t n, size_t &ip, size_t &len)
+{
+  uint8_t b;
+  do
+  {
+    if (ip >= n)
+    {
+      return false;
+    }
+    b = src[ip++];
+    len += b;
+  } while (b == 255);
+  return true;
+}
+
+// decompress into exactly dst_size bytes, return false if the input is corrupted
+inline static bool lz_decompress(const uint8_t *src, size_t n, uint8_t *dst, size_t dst_size)
+{
+  size_t ip = 0;
+  size_t op = 0;
+  while (ip < n)
+  {
+    uint8_t token = src[ip++];
+    size_t n_lit = token >> 4;
+    if (n_lit == 15 && !lz_read_len(src, n, ip, n_lit))
+    {
+      return false;
+    }
+    if (n_lit > n - ip || n_lit > dst_size - op)
+    {
+      return false;
+    }
+    memcpy(dst + op, src + ip, n_lit);
+    ip += n_lit;
+    op += n_lit;
+    if (ip == n)
+    {
+      break; // last sequence
+    }
+    if (n - ip < 2)
+    {
+      return false;
+    }
+    size_t offset = src[ip] | (src[ip + 1] << 8);
+    ip += 2;
+    size_t len = token & 15;
+    if (len == 15 && !lz_read_len(src, n, ip, len))
+    {
+      return false;
+    }
+    len += LZ_MIN_MATCH;
+    if (offset == 0 || offset > op || len > dst_size - op)
+    {
+      return false;
+    }
+    const uint8_t *match = dst + op - offset;
+    if (offset >= len)
+    {
+      memcpy(dst + op, match, len);
+    }
+    else
+    {
+      // overlapping, repeats the last offset bytes
+      for (size_t k = 0; k < len; k++)
+      {
+        dst[op + k] = match[k];
+      }
+    }
+    op += len;
+  }
+  return op == dst_size;
+}
@@ -84,6 +84,20 @@ class CacheManager {
     return await opfsWrite(name, stream);
   }
 
+  /**
+   * Write data produced locally (not downloaded), for example the prompt cache. This will overwrite existing file.
+   *
+   * @param key Used in place of the URL, the file can then be opened or deleted with this key
+   */
+  async writeBlob(key: string, blob: Blob): Promise<void> {
+    await this.writeMetadata(key, {
+      etag: '',
+      originalSize: blob.size,
+      originalURL: key,
+    });
+    await opfsWrite(key, blob.stream());
+  }
+
   async download(url: string, options: DownloadOptions = {}): Promise<void> {
     const worker = createWorker(OPFS_UTILS_WORKER_CODE);
     let aborted = false;
@@ -1,3 +1,4 @@
 export * from './wllama';
 export * from './cache-manager';
 export * from './model-manager';
+export * from './prompt-cache';
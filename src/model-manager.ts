@@ -1,6 +1,7 @@
 import CacheManager, { CacheEntry, DownloadOptions } from './cache-manager';
 import { sumArr } from './utils';
 import { WllamaError, WllamaLogger } from './wllama';
+import { PROMPT_CACHE_KEY_PREFIX } from './prompt-cache';
 
 const DEFAULT_PARALLEL_DOWNLOADS = 3;
 
@@ -256,6 +257,9 @@ export class ModelManager {
     const cachedFiles = await this.cacheManager.list();
     let models: Model[] = [];
     for (const file of cachedFiles) {
+      if (file.metadata.originalURL.startsWith(PROMPT_CACHE_KEY_PREFIX)) {
+        continue; // not a model
+      }
       const shards = ModelManager.parseModelUrl(file.metadata.originalURL);
       const isFirstShard =
         shards.length === 1 || shards[0] === file.metadata.originalURL;
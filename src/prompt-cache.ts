@@ -0,0 +1,170 @@
+import CacheManager from './cache-manager';
+import { sumArr } from './utils';
+
+/**
+ * Keys of the prompt cache entries in CacheManager, used in place of an URL
+ */
+export const PROMPT_CACHE_KEY_PREFIX = 'wllama-prompt-cache/';
+
+export interface PromptCacheOptions {
+  /**
+   * Prefixes are cached at multiples of this number of tokens, so that prompts sharing a long beginning (for example a system prompt) share the same entry.
+   *
+   * Default: 256
+   */
+  blockSize?: number;
+  /**
+   * A prefix is saved once it has been processed this many times in the current page.
+   *
+   * Default: 2
+   */
+  minHits?: number;
+  /**
+   * Max total size in bytes of the saved prefixes (all models together), the oldest ones are deleted first.
+   *
+   * Default: 512MB
+   */
+  maxBytes?: number;
+}
+
+/**
+ * Rolling hash of the prefixes of tokens whose length is a multiple of blockSize
+ * @returns For each of these prefixes, its number of tokens and its hash (64 bits, hex)
+ */
+export function hashTokenPrefixes(
+  tokens: number[],
+  blockSize: number
+): { nTokens: number; hash: string }[] {
+  const hex32 = (h: number) => (h >>> 0).toString(16).padStart(8, '0');
+  const output: { nTokens: number; hash: string }[] = [];
+  // two independent 32-bit hashes, as 64-bit integer math is slow in JS
+  let h1 = 0x811c9dc5;
+  let h2 = 0x9e3779b9;
+  for (let i = 0; i < tokens.length; i++) {
+    h1 = Math.imul(h1 ^ tokens[i], 0x01000193);
+    h2 = Math.imul(h2 ^ tokens[i], 0x5bd1e995);
+    h2 ^= h2 >>> 15;
+    if ((i + 1) % blockSize === 0) {
+      output.push({ nTokens: i + 1, hash: hex32(h1) + hex32(h2) });
+    }
+  }
+  return output;
+}
+
+/**
+ * Persistent cache of KV states for prompt prefixes, stored in OPFS through CacheManager.
+ *
+ * Entries are keyed by the fingerprint of the model and context options, and by the hash of the prefix tokens. They are in the session format (see `Wllama.sessionExport()`).
+ */
+export class PromptCache {
+  private cacheManager: CacheManager;
+  private fingerprint: string;
+  private blockSize: number;
+  private minHits: number;
+  private maxBytes: number;
+  // number of times each prefix was processed in this page
+  private hits = new Map<string, number>();
+  // keys known to be saved
+  private stored = new Set<string>();
+
+  constructor(
+    cacheManager: CacheManager,
+    fingerprint: string,
+    options: PromptCacheOptions = {}
+  ) {
+    this.cacheManager = cacheManager;
+    this.fingerprint = fingerprint;
+    this.blockSize = options.blockSize ?? 256;
+    this.minHits = options.minHits ?? 2;
+    this.maxBytes = options.maxBytes ?? 512 * 1024 * 1024;
+  }
+
+  /**
+   * Find the longest saved prefix of the given tokens, only if it has more than minTokens tokens.
+   * The prefix is strictly shorter than the tokens, so that at least one token is left to decode (a restored session has no logits).
+   */
+  async findLongest(
+    tokens: number[],
+    minTokens: number
+  ): Promise<{ key: string; nTokens: number; blob: Blob } | null> {
+    const prefixes = hashTokenPrefixes(tokens, this.blockSize);
+    for (let i = prefixes.length - 1; i >= 0; i--) {
+      if (prefixes[i].nTokens <= minTokens) {
+        break;
+      }
+      if (prefixes[i].nTokens >= tokens.length) {
+        continue;
+      }
+      const key = this.getKey(prefixes[i]);
+      const blob = await this.cacheManager.open(key);
+      if (blob && blob.size > 0) {
+        this.stored.add(key);
+        return { key, nTokens: prefixes[i].nTokens, blob };
+      }
+    }
+    return null;
+  }
+
+  /**
+   * Count a processed prompt
+   * @returns The longest prefix which should now be saved (processed at least minHits times and not saved yet), or null
+   */
+  recordPrompt(tokens: number[]): { key: string; nTokens: number } | null {
+    let output: { key: string; nTokens: number } | null = null;
+    for (const prefix of hashTokenPrefixes(tokens, this.blockSize)) {
+      const key = this.getKey(prefix);
+      const hits = (this.hits.get(key) ?? 0) + 1;
+      this.hits.set(key, hits);
+      if (hits >= this.minHits && !this.stored.has(key)) {
+        output = { key, nTokens: prefix.nTokens };
+      }
+    }
+    return output;
+  }
+
+  /**
+   * Save an entry, then delete the oldest entries if the cache is over budget
+   */
+  async save(key: string, data: Blob): Promise<void> {
+    this.stored.add(key);
+    if ((await this.cacheManager.getSize(key)) > 0) {
+      return; // saved in a previous page
+    }
+    await this.cacheManager.writeBlob(key, data);
+    await this.evict();
+  }
+
+  async delete(key: string): Promise<void> {
+    this.stored.delete(key);
+    await this.cacheManager.delete(key);
+  }
+
+  private getKey(prefix: { nTokens: number; hash: string }): string {
+    return `${PROMPT_CACHE_KEY_PREFIX}${this.fingerprint}/${prefix.nTokens}_${prefix.hash}.session`;
+  }
+
+  private async evict(): Promise<void> {
+    const entries = (await this.cacheManager.list()).filter((e) =>
+      e.metadata.originalURL.startsWith(PROMPT_CACHE_KEY_PREFIX)
+    );
+    let total = sumArr(entries.map((e) => e.size));
+    if (total <= this.maxBytes) {
+      return;
+    }
+    const dated = await Promise.all(
+      entries.map(async (entry) => {
+        const file = (await this.cacheManager.open(entry.name)) as File | null;
+        return { entry, time: file?.lastModified ?? 0 };
+      })
+    );
+    dated.sort((a, b) => a.time - b.time);
+    for (const { entry } of dated) {
+      if (total <= this.maxBytes) {
+        break;
+      }
+      this.stored.delete(entry.metadata.originalURL);
+      await this.cacheManager.delete(entry.name);
+      total -= entry.size;
+    }
+  }
+}
@@ -1,5 +1,13 @@
 import { test, expect } from 'vitest';
-import { Wllama, WllamaChatMessage } from './wllama';
+import {
+  SamplerType,
+  SamplingConfig,
+  TokenAttr,
+  Wllama,
+  WllamaChatMessage,
+} from './wllama';
+import { CacheEntry } from './cache-manager';
+import { PROMPT_CACHE_KEY_PREFIX } from './prompt-cache';
 
 const CONFIG_PATHS = {
   'single-thread/wllama.wasm': '/src/single-thread/wllama.wasm',
@@ -14,6 +22,12 @@ const SPLIT_MODEL =
 
 const EMBD_MODEL = TINY_MODEL; // for better speed
 
+const ENCODER_MODEL =
+  'https://huggingface.co/Felladrin/gguf-flan-t5-small/resolve/main/flan-t5-small.Q3_K_M.gguf';
+
+const RERANK_MODEL =
+  'https://huggingface.co/ggml-org/models/resolve/main/jina-reranker-v1-tiny-en/ggml-model-f16.gguf';
+
 test.sequential('loads single model file', async () => {
   const wllama = new Wllama(CONFIG_PATHS);
 
@@ -119,6 +133,59 @@ test.sequential('tokenizes and detokenizes text', async () => {
   const decodedText = new TextDecoder().decode(detokenized);
   expect(decodedText.trim()).toBe(text);
 
+  const texts = [text, 'Hello world', ''];
+  const batch = await wllama.tokenizeBatch(texts);
+  expect(batch.length).toBe(3);
+  expect(Array.from(batch[0])).toEqual(tokens);
+  expect(batch[2].length).toBe(0);
+  const counts = await wllama.countTokens(texts);
+  expect(counts).toEqual(batch.map((t) => t.length));
+
+  const longText = `${text}\nHello world, this is a longer text`;
+  expect(await wllama.tokenize(text, true, true)).toEqual(
+    await wllama.tokenize(text, true)
+  );
+  expect(await wllama.tokenize(longText, true, true)).toEqual(
+    await wllama.tokenize(longText, true)
+  );
+
+  const stream = await wllama.tokenizeStreamOpen();
+  const streamed: number[] = [];
+  for (const chunk of ['Hello wor', 'ld, this is', ' a longer', ' text']) {
+    streamed.push(...(await wllama.tokenizeStreamFeed(stream, chunk)));
+  }
+  streamed.push(...(await wllama.tokenizeStreamFeed(stream, '', true)));
+  expect(streamed).toEqual(
+    await wllama.tokenize('Hello world, this is a longer text')
+  );
+
+  const lookup = await wllama.lookupTokens(['<s>', 'not a piece in vocab']);
+  expect(lookup).toEqual([wllama.getBOS(), -1]);
+
+  const vocab = await wllama.getVocab();
+  expect(vocab.length).toBe(wllama.getModelMetadata().hparams.nVocab);
+  const vocabPage = await wllama.getVocabBinary({ start: 100, end: 200 });
+  expect(vocabPage.offsets.length).toBe(101);
+  expect(vocabPage.attrs.length).toBe(100);
+  expect(
+    vocabPage.pieces.subarray(vocabPage.offsets[5], vocabPage.offsets[6])
+  ).toEqual(vocab[105]);
+  const eosAttr = (await wllama.getVocabBinary()).attrs[wllama.getEOS()];
+  expect(eosAttr & TokenAttr.EOG).toBeTruthy();
+
+  // stream tokens one by one, unfinished unicode must not be returned
+  const unicodeText = 'Thé 💖';
+  const unicodeTokens = await wllama.tokenize(unicodeText);
+  let streamedText = '';
+  for (let i = 0; i < unicodeTokens.length; i++) {
+    const newText = await wllama.detokenizeStream([unicodeTokens[i]], {
+      reset: i === 0,
+    });
+    expect(newText).not.toContain('\uFFFD');
+    streamedText += newText;
+  }
+  expect(streamedText.trim()).toBe(unicodeText);
+
   await wllama.exit();
 });
 
@@ -148,6 +215,406 @@ test.sequential('generates completion', async () => {
   expect(completion).toMatch(/(there|little|girl|Lily)+/);
   expect(completion.length).toBeGreaterThan(10);
 
+  // not an encoder-decoder model
+  await expect(
+    wllama.createSeq2SeqCompletion(prompt, { nPredict: 10 })
+  ).rejects.toThrow();
+
+  await wllama.exit();
+});
+
+test.sequential('generates completion with encoder-decoder model', async () => {
+  const wllama = new Wllama(CONFIG_PATHS);
+
+  await wllama.loadModelFromUrl(ENCODER_MODEL, {
+    n_ctx: 512,
+  });
+
+  const source = 'translate English to German: How old are you?';
+  const output = await wllama.createSeq2SeqCompletion(source, {
+    nPredict: 20,
+    sampling: { temp: 0.0 },
+  });
+  expect(output).toContain('Wie alt');
+
+  // the same source is encoded once,
+  // and an explicit seed makes each pass reproducible
+  await wllama.samplingInit({ temp: 1.0 });
+  const tokens = await wllama.tokenize('translate English to German: Hello');
+  const stopTokens = [wllama.getEOS()];
+  const pass0 = await wllama.encodeGenerate(tokens, {
+    nPredict: 10,
+    stopTokens,
+    seed: 42,
+  });
+  expect(pass0.reusedEncoding).toBe(false);
+  const pass1 = await wllama.encodeGenerate(tokens, {
+    nPredict: 10,
+    stopTokens,
+    seed: 42,
+  });
+  expect(pass1.reusedEncoding).toBe(true);
+  expect(pass1.tokens).toEqual(pass0.tokens);
+
+  await wllama.exit();
+});
+
+test.sequential('generates completion with samplers_sequence', async () => {
+  const wllama = new Wllama(CONFIG_PATHS);
+
+  await wllama.loadModelFromUrl(TINY_MODEL, {
+    n_ctx: 1024,
+  });
+
+  const config: SamplingConfig = {
+    temp: 0.0,
+    top_k: 40,
+    samplers_sequence: ['temperature', 'top_k'],
+  };
+
+  const completion = await wllama.createCompletion('Once upon a time', {
+    nPredict: 10,
+    sampling: config,
+  });
+  expect(completion.length).toBeGreaterThan(10);
+
+  await expect(
+    wllama.samplingInit({ samplers_sequence: ['invalid' as SamplerType] })
+  ).rejects.toThrow();
+
+  await wllama.exit();
+});
+
+test.sequential('snapshots and restores sampling context', async () => {
+  const wllama = new Wllama(CONFIG_PATHS);
+
+  await wllama.loadModelFromUrl(TINY_MODEL, {
+    n_ctx: 1024,
+  });
+
+  await wllama.samplingInit({ temp: 1.0 });
+  const tokens = await wllama.tokenize('Once upon a time');
+  await wllama.samplingAccept(tokens);
+  await wllama.decode(tokens, {});
+
+  const handle = await wllama.samplingSnapshot();
+  const sampled0 = await wllama.samplingSample();
+  await wllama.samplingRestore(handle);
+  const sampled1 = await wllama.samplingSample();
+  expect(sampled1.token).toBe(sampled0.token);
+
+  await wllama.samplingSnapshotFree(handle);
+  await expect(wllama.samplingRestore(handle)).rejects.toThrow();
+
+  // retrying a token must not feed the discarded piece to the stop strings
+  await wllama.samplingInit({
+    temp: 1.0,
+    stop_strings: [' there was', ', the end'],
+  });
+  await wllama.samplingAccept(tokens);
+  const retry = await wllama.samplingSnapshot();
+  const first = await wllama.samplingSample();
+  await wllama.samplingRestore(retry);
+  const second = await wllama.samplingSample();
+  expect(second.token).toBe(first.token);
+  expect(second.stopped).toBe(first.stopped);
+  expect(Array.from(second.piece)).toEqual(Array.from(first.piece));
+  expect(Array.from(second.pending)).toEqual(Array.from(first.pending));
+  expect(second.text).toBe(first.text);
+  await wllama.samplingSnapshotFree(retry);
+
+  await wllama.exit();
+});
+
+test.sequential('generates completion with beam search', async () => {
+  const wllama = new Wllama(CONFIG_PATHS);
+
+  await wllama.loadModelFromUrl(TINY_MODEL, {
+    n_ctx: 1024,
+    n_seq_max: 5,
+  });
+
+  const tokens = await wllama.tokenize('Once upon a time');
+  tokens.unshift(wllama.getBOS());
+  await wllama.kvClear();
+  await wllama.decode(tokens, {});
+
+  const hypotheses = await wllama.beamSearch({
+    nPredict: 10,
+    nBeams: 4,
+    nBest: 2,
+  });
+  expect(hypotheses.length).toBe(2);
+  expect(hypotheses[0].tokens.length).toBeGreaterThan(0);
+  expect(hypotheses[0].score).toBeGreaterThanOrEqual(hypotheses[1].score);
+
+  const text = new TextDecoder().decode(
+    await wllama.detokenize(hypotheses[0].tokens)
+  );
+  expect(text.length).toBeGreaterThan(10);
+
+  await wllama.exit();
+});
+
+test.sequential('saves and restores kv snapshots', async () => {
+  const wllama = new Wllama(CONFIG_PATHS);
+
+  await wllama.loadModelFromUrl(TINY_MODEL, {
+    n_ctx: 1024,
+  });
+
+  const tokens = await wllama.tokenize('Once upon a time');
+  tokens.unshift(wllama.getBOS());
+  const [next] = await wllama.tokenize(' there');
+  await wllama.kvClear();
+  await wllama.decode(tokens, {});
+  const nBytes = await wllama.kvSnapshotSave('a');
+  expect(nBytes).toBeGreaterThan(0);
+  await wllama.decode([next], {});
+  const logits0 = await wllama.getLogits(10);
+
+  await wllama.kvClear();
+  await wllama.kvSnapshotLoad('a');
+  await wllama.decode([next], {});
+  const logits1 = await wllama.getLogits(10);
+  expect(logits1.map((l) => l.token)).toEqual(logits0.map((l) => l.token));
+
+  const snapshot = await wllama.kvSnapshotExport('a');
+  expect(snapshot.data.byteLength).toBe(nBytes);
+  expect(snapshot.tokens).toEqual(tokens);
+  await wllama.kvSnapshotImport('b', snapshot);
+  await wllama.kvClear();
+  await wllama.kvSnapshotLoad('b');
+  await wllama.decode([next], {});
+  const logits2 = await wllama.getLogits(10);
+  expect(logits2.map((l) => l.token)).toEqual(logits0.map((l) => l.token));
+
+  const usage = await wllama.setKVSnapshotBudget();
+  expect(usage.names).toEqual(['b', 'a']);
+  expect(await wllama.kvSnapshotDelete('a')).toBe(true);
+  await expect(wllama.kvSnapshotLoad('a')).rejects.toThrow();
+
+  // saving again under the same name replaces the snapshot without leaking its size
+  const entryBytes = nBytes + tokens.length * 4;
+  await wllama.setKVSnapshotBudget(2 * entryBytes);
+  await wllama.kvSnapshotLoad('b');
+  await wllama.kvSnapshotSave('c');
+  await wllama.kvSnapshotSave('c');
+  const usage1 = await wllama.setKVSnapshotBudget();
+  expect(usage1.names).toEqual(['c', 'b']);
+  expect(usage1.nBytes).toBe(2 * entryBytes);
+
+  await wllama.exit();
+});
+
+test.sequential('saves and restores incremental kv checkpoints', async () => {
+  const wllama = new Wllama(CONFIG_PATHS);
+
+  await wllama.loadModelFromUrl(TINY_MODEL, {
+    n_ctx: 1024,
+    n_seq_max: 2,
+  });
+
+  const tokens = await wllama.tokenize('Once upon a time, there was a');
+  tokens.unshift(wllama.getBOS());
+  const [next] = await wllama.tokenize(' little');
+  await wllama.kvClear();
+  await wllama.decode(tokens.slice(0, 4), {});
+  const info0 = await wllama.kvCheckpointSave('chat', { maxParts: 2 });
+  expect(info0.nParts).toBe(1);
+  await wllama.decode(tokens.slice(4), {});
+  const info1 = await wllama.kvCheckpointSave('chat', { maxParts: 2 });
+  expect(info1.nParts).toBe(2);
+  expect(info1.nBytesWritten).toBeLessThan(info1.nBytes);
+  await wllama.decode([next], {});
+  const logits0 = await wllama.getLogits(10);
+
+  await wllama.kvClear();
+  await wllama.kvCheckpointLoad('chat');
+  await wllama.decode([next], {});
+  const logits1 = await wllama.getLogits(10);
+  expect(logits1.map((l) => l.token)).toEqual(logits0.map((l) => l.token));
+
+  // the chain is full, it is compacted
+  const info2 = await wllama.kvCheckpointSave('chat', { maxParts: 2 });
+  expect(info2.nParts).toBe(1);
+  expect(info2.compacted).toBe(true);
+
+  expect(await wllama.kvCheckpointDelete('chat')).toBe(true);
+  await expect(wllama.kvCheckpointLoad('chat')).rejects.toThrow();
+
+  await wllama.exit();
+});
+
+test.sequential('saves and loads compressed session files', async () => {
+  const wllama = new Wllama(CONFIG_PATHS);
+
+  await wllama.loadModelFromUrl(TINY_MODEL, {
+    n_ctx: 1024,
+  });
+
+  const tokens = await wllama.tokenize('Once upon a time');
+  tokens.unshift(wllama.getBOS());
+  const [next] = await wllama.tokenize(' there');
+  await wllama.kvClear();
+  await wllama.decode(tokens, {});
+  const saved = await wllama.sessionSave('/tmp/session.bin');
+  expect(saved.tokens).toEqual(tokens);
+  expect(saved.nBytes).toBeGreaterThan(0);
+  await wllama.decode([next], {});
+  const logits0 = await wllama.getLogits(10);
+
+  await wllama.kvClear();
+  await wllama.sessionLoad('/tmp/session.bin');
+  await wllama.decode([next], {});
+  const logits1 = await wllama.getLogits(10);
+  expect(logits1.map((l) => l.token)).toEqual(logits0.map((l) => l.token));
+
+  await expect(wllama.sessionLoad('/tmp/missing.bin')).rejects.toThrow();
+
+  // restore from a stream, the file is split in several chunks
+  await wllama.exit();
+  await wllama.loadModelFromUrl(TINY_MODEL, {
+    n_ctx: 1024,
+    n_seq_max: 2,
+  });
+  await wllama.kvClear();
+  await wllama.decode(tokens, {});
+  const exported = await wllama.sessionExport({ chunkSize: 1024 });
+  expect(exported.tokens).toEqual(tokens);
+  expect(exported.nChunks).toBeGreaterThan(1);
+  // a failing stream cancels the load
+  const failing = new ReadableStream<Uint8Array>({
+    start(controller) {
+      controller.enqueue(new Uint8Array(exported.data.slice(0, 100)));
+      controller.error(new Error('network error'));
+    },
+  });
+  await expect(wllama.sessionLoadFromStream(failing)).rejects.toThrow(
+    'network error'
+  );
+  await wllama.kvClear();
+  await wllama.sessionLoadFromStream(new Blob([exported.data]));
+  await wllama.decode([next], {});
+  const logits2 = await wllama.getLogits(10);
+  expect(logits2.map((l) => l.token)).toEqual(logits0.map((l) => l.token));
+
+  await wllama.exit();
+});
+
+test.sequential('restores prompt prefixes from the prompt cache', async () => {
+  const debugLogs: string[] = [];
+  const wllama = new Wllama(CONFIG_PATHS, {
+    logger: {
+      ...console,
+      debug: (...args: unknown[]) => debugLogs.push(args.join(' ')),
+    },
+  });
+  const isPromptCacheEntry = (e: CacheEntry) =>
+    e.metadata.originalURL.startsWith(PROMPT_CACHE_KEY_PREFIX);
+  await wllama.cacheManager.deleteMany(isPromptCacheEntry);
+
+  const config = { n_ctx: 1024, n_seq_max: 2 };
+  const options = { nPredict: 10, sampling: { temp: 0.0 } };
+  const prompt =
+    'Once upon a time, there was a little girl who lived in a village near the forest. Whenever she went out, the little girl';
+
+  await wllama.loadModelFromUrl(TINY_MODEL, config);
+  wllama.setPromptCache({ blockSize: 8, minHits: 1 });
+  const completion0 = await wllama.createCompletion(prompt, options);
+  await wllama.exit(); // waits for the prompt cache to be written
+
+  const entries = (await wllama.cacheManager.list()).filter(
+    isPromptCacheEntry
+  );
+  expect(entries.length).toBe(1);
+
+  // after reloading, the prefix is restored instead of being processed again
+  await wllama.loadModelFromUrl(TINY_MODEL, config);
+  wllama.setPromptCache({ blockSize: 8, minHits: 1 });
+  debugLogs.length = 0;
+  const completion1 = await wllama.createCompletion(prompt, options);
+  expect(completion1).toBe(completion0);
+  expect(debugLogs.some((l) => l.startsWith('Prompt cache hit'))).toBe(true);
+
+  // a prompt of exactly blockSize tokens is saved, but never fully restored,
+  // as its logits are needed
+  const shortPrompt = 'Once upon a time';
+  // with BOS
+  const blockSize = (await wllama.tokenize(shortPrompt, true)).length + 1;
+  wllama.setPromptCache({ blockSize, minHits: 1 });
+  const short0 = await wllama.createCompletion(shortPrompt, options);
+  await wllama.exit();
+  expect(
+    (await wllama.cacheManager.list()).filter(isPromptCacheEntry).length
+  ).toBe(2);
+  await wllama.loadModelFromUrl(TINY_MODEL, config);
+  wllama.setPromptCache({ blockSize, minHits: 1 });
+  debugLogs.length = 0;
+  const short1 = await wllama.createCompletion(shortPrompt, options);
+  expect(short1).toBe(short0);
+  expect(debugLogs.some((l) => l.startsWith('Prompt cache hit'))).toBe(false);
+
+  // prefixes cannot be saved with a single sequence
+  await wllama.exit();
+  await wllama.loadModelFromUrl(TINY_MODEL, { n_ctx: 1024, n_seq_max: 1 });
+  expect(() => wllama.setPromptCache({})).toThrow();
+
+  await wllama.exit();
+  await wllama.cacheManager.deleteMany(isPromptCacheEntry);
+});
+
+test.sequential('generates parallel completions', async () => {
+  const wllama = new Wllama(CONFIG_PATHS);
+
+  await wllama.loadModelFromUrl(TINY_MODEL, {
+    n_ctx: 1024,
+    n_seq_max: 5,
+  });
+
+  const completions = await wllama.createParallelCompletions(
+    'Once upon a time',
+    4,
+    {
+      nPredict: 10,
+      sampling: { temp: 1.0 },
+    }
+  );
+  expect(completions.length).toBe(4);
+  for (const completion of completions) {
+    expect(completion.length).toBeGreaterThan(0);
+  }
+  // each completion is seeded differently
+  expect(new Set(completions).size).toBeGreaterThan(1);
+
+  await wllama.exit();
+});
+
+test.sequential('generates completion with stop strings', async () => {
+  const wllama = new Wllama(CONFIG_PATHS);
+
+  await wllama.loadModelFromUrl(TINY_MODEL, {
+    n_ctx: 1024,
+  });
+
+  const prompt = 'Once upon a time';
+  const config: SamplingConfig = {
+    temp: 0.0,
+    top_k: 40,
+  };
+  const completion = await wllama.createCompletion(prompt, {
+    nPredict: 20,
+    sampling: config,
+  });
+  const stopString = completion.substring(5, 9);
+  const stoppedCompletion = await wllama.createCompletion(prompt, {
+    nPredict: 20,
+    sampling: { ...config, stop_strings: [stopString, 'not found'] },
+  });
+  expect(stoppedCompletion).toBe(
+    completion.substring(0, completion.indexOf(stopString))
+  );
+
   await wllama.exit();
 });
 
@@ -205,6 +672,205 @@ test.sequential('generates embeddings', async () => {
   expect(cosineDist).toBeGreaterThan(1 - 0.05);
   expect(cosineDist).toBeLessThan(1);
 
+  // batched embeddings should match the single ones
+  const batch = await wllama.createEmbeddings([text, text + ' ', 'Hello']);
+  expect(batch.length).toBe(3);
+  expect(batch[0].length).toBe(embedding.length);
+  for (let i = 0; i < embedding.length; i++) {
+    expect(batch[0][i]).toBeCloseTo(embedding[i], 3);
+    expect(batch[1][i]).toBeCloseTo(embedding2[i], 3);
+  }
+
+  // embeddings cache
+  await wllama.setEmbeddingsCache(1024 * 1024);
+  const cached1 = await wllama.createEmbeddings([text]);
+  const cached2 = await wllama.createEmbeddings([text]);
+  expect(Array.from(cached2[0])).toEqual(Array.from(cached1[0]));
+  expect((await wllama.setEmbeddingsCache(1024 * 1024)).nEntries).toBe(1);
+  expect(await wllama.embeddingsCacheSave('/embd_cache.bin')).toBe(1);
+  await wllama.setEmbeddingsCache(0);
+  await wllama.setEmbeddingsCache(1024 * 1024);
+  expect(await wllama.embeddingsCacheLoad('/embd_cache.bin')).toBe(1);
+
+  // vector index
+  for (const type of ['flat', 'hnsw'] as const) {
+    const index = await wllama.vectorIndexCreate({ type });
+    const docs = ['The cat sits on the mat', 'Stock markets fell today', text];
+    expect(await wllama.vectorIndexAddTexts(index, [1, 2, 3], docs)).toBe(3);
+    const found = await wllama.vectorIndexSearchText(index, text, { k: 2 });
+    expect(found.ids[0]).toBe(3);
+    expect(found.scores[0]).toBeCloseTo(1, 3);
+    expect(found.ids.length).toBe(2);
+    expect(await wllama.vectorIndexRemove(index, [3])).toBe(2);
+    await wllama.vectorIndexSave(index, '/index.bin');
+    await wllama.vectorIndexFree(index);
+    const loaded = await wllama.vectorIndexLoad('/index.bin');
+    expect(loaded.nVectors).toBe(2);
+    const results = await wllama.vectorIndexSearch(
+      loaded.handle,
+      { vectors: embedding },
+      { k: 5 }
+    );
+    expect(results[0].ids).not.toContain(3);
+    await wllama.vectorIndexFree(loaded.handle);
+  }
+
+  // long document, split into windows
+  const longText = Array(20).fill(text).join('. ');
+  const long = await wllama.createLongEmbedding(longText, {
+    window: 32,
+    overlap: 8,
+    returnWindows: true,
+  });
+  expect(long.embedding.length).toBe(embedding.length);
+  expect(long.windows!.length).toBeGreaterThan(1);
+  expect(long.windows![1].start).toBe(24);
+  const normLong = Math.sqrt(
+    long.embedding.reduce((acc, v) => acc + v * v, 0)
+  );
+  expect(Math.abs(normLong - 1)).toBeLessThan(1e-5);
+
+  // not a reranker model
+  await expect(wllama.rerank(text, ['Hello'])).rejects.toThrow();
+
+  // compact formats
+  const tokens = [
+    wllama.getBOS(),
+    ...(await wllama.tokenize(text)),
+    wllama.getEOS(),
+  ];
+  const int8 = await wllama.embeddingsPacked([tokens], { format: 'int8' });
+  expect(int8.data.length).toBe(embedding.length);
+  expect(int8.scales!.length).toBe(1);
+  expect(int8.data[0] * int8.scales![0]).toBeCloseTo(embedding[0], 1);
+  const bin = await wllama.embeddingsPacked([tokens], { format: 'binary' });
+  expect(bin.data.length).toBe(Math.ceil(embedding.length / 8));
+  const truncated = await wllama.embeddingsPacked([tokens], { dims: 32 });
+  expect(truncated.nEmbd).toBe(32);
+  const normTrunc = Math.sqrt(
+    (truncated.data as Float32Array).reduce((acc, v) => acc + v * v, 0)
+  );
+  expect(Math.abs(normTrunc - 1)).toBeLessThan(1e-5);
+
+  await wllama.exit();
+});
+
+test.sequential('reranks documents by relevance', async () => {
+  const wllama = new Wllama(CONFIG_PATHS);
+
+  await wllama.loadModelFromUrl(RERANK_MODEL, {
+    n_ctx: 512,
+    embeddings: true,
+    pooling_type: 'LLAMA_POOLING_TYPE_RANK',
+  });
+
+  const documents = [
+    'Paris is the capital of France, known for the Eiffel Tower.',
+    'Machine learning is a field of study in artificial intelligence.',
+    'A recipe for apple pie with cinnamon and butter.',
+  ];
+  const results = await wllama.rerank('What is machine learning?', documents);
+  expect(results.length).toBe(documents.length);
+  expect(results[0].index).toBe(1);
+  const score = (i: number) => results.find((r) => r.index === i)!.score;
+  expect(score(1)).toBeGreaterThan(score(0));
+  expect(score(1)).toBeGreaterThan(score(2));
+
+  const top = await wllama.rerank('What is machine learning?', documents, {
+    topN: 1,
+  });
+  expect(top.map((r) => r.index)).toEqual([1]);
+
+  await wllama.exit();
+});
+
+test.sequential('hnsw vector index recall matches flat search', async () => {
+  const wllama = new Wllama(CONFIG_PATHS);
+
+  await wllama.loadModelFromUrl(TINY_MODEL, {
+    n_ctx: 1024,
+  });
+
+  // deterministic gaussian vectors (LCG + Box-Muller)
+  let seed = 1234;
+  const rand = () => {
+    seed = (Math.imul(seed, 1664525) + 1013904223) >>> 0;
+    return (seed + 1) / 4294967297;
+  };
+  const randomVectors = (n: number, dims: number) => {
+    const output = new Float32Array(n * dims);
+    for (let i = 0; i < output.length; i++) {
+      output[i] =
+        Math.sqrt(-2 * Math.log(rand())) * Math.cos(2 * Math.PI * rand());
+    }
+    return output;
+  };
+  const dims = 32;
+  const nVectors = 1000;
+  const nQueries = 50;
+  const k = 10;
+  const vectors = randomVectors(nVectors, dims);
+  const ids = Array.from({ length: nVectors }, (_, i) => i);
+  const queries = randomVectors(nQueries, dims);
+
+  const flat = await wllama.vectorIndexCreate({ type: 'flat', dims });
+  const hnsw = await wllama.vectorIndexCreate({ type: 'hnsw', dims });
+  await wllama.vectorIndexAdd(flat, ids, { vectors });
+  await wllama.vectorIndexAdd(hnsw, ids, { vectors });
+  const exact = await wllama.vectorIndexSearch(
+    flat,
+    { vectors: queries },
+    { k }
+  );
+  const approx = await wllama.vectorIndexSearch(
+    hnsw,
+    { vectors: queries },
+    { k }
+  );
+  let nFound = 0;
+  for (let i = 0; i < nQueries; i++) {
+    const expected = new Set(exact[i].ids);
+    nFound += approx[i].ids.filter((id) => expected.has(id)).length;
+  }
+  expect(nFound / (nQueries * k)).toBeGreaterThanOrEqual(0.9);
+
+  await expect(
+    wllama.vectorIndexSearch(flat, { vectors: queries }, { k: 0 })
+  ).rejects.toThrow();
+
+  await wllama.vectorIndexFree(flat);
+  await wllama.vectorIndexFree(hnsw);
+  await wllama.exit();
+});
+
+test.sequential('generates token embeddings', async () => {
+  const wllama = new Wllama(CONFIG_PATHS);
+
+  await wllama.loadModelFromUrl(EMBD_MODEL, {
+    n_ctx: 1024,
+    embeddings: true,
+    pooling_type: 'LLAMA_POOLING_TYPE_NONE',
+  });
+
+  const tokens = await wllama.tokenize('This is a test sentence');
+  const result = await wllama.embeddingsTokens(tokens);
+  const nEmbd = wllama.getModelMetadata().hparams.nEmbd;
+  expect(result.nTokens).toBe(tokens.length);
+  expect(result.nEmbd).toBe(nEmbd);
+  expect(result.data.length).toBe(tokens.length * nEmbd);
+
+  // project to the first 2 dimensions
+  const matrix = new Float32Array(2 * nEmbd);
+  matrix[0] = 1;
+  matrix[nEmbd + 1] = 1;
+  await wllama.setEmbeddingsProjection(matrix, 2);
+  const projected = await wllama.embeddingsTokens(tokens, { project: true });
+  expect(projected.nEmbd).toBe(2);
+  const data = projected.data as Float32Array;
+  const first = result.data as Float32Array;
+  const norm = Math.hypot(first[0], first[1]);
+  expect(data[0]).toBeCloseTo(first[0] / norm, 4);
+
   await wllama.exit();
 });
 
@@ -5,12 +5,12 @@ import {
   checkEnvironmentCompatible,
   isString,
   isSupportMultiThread,
-  joinBuffers,
   sortFileByShard,
   padDigits,
 } from './utils';
 import CacheManager, { DownloadOptions } from './cache-manager';
 import { ModelManager, Model } from './model-manager';
+import { PromptCache, PromptCacheOptions } from './prompt-cache';
 
 const HF_MODEL_ID_REGEX = /^([a-zA-Z0-9_\-\.]+)\/([a-zA-Z0-9_\-\.]+)$/;
 const HF_MODEL_ID_REGEX_EXPLAIN =
@@ -69,6 +69,8 @@ export interface LoadModelConfig {
   seed?: number;
   n_ctx?: number;
   n_batch?: number;
+  // maximum number of sequences in KV cache, for example beam search needs nBeams + 1
+  n_seq_max?: number;
   // by default, on multi-thread build, we take half number of available threads (hardwareConcurrency / 2)
   n_threads?: number;
   embeddings?: boolean;
@@ -77,7 +79,10 @@ export interface LoadModelConfig {
     | 'LLAMA_POOLING_TYPE_UNSPECIFIED'
     | 'LLAMA_POOLING_TYPE_NONE'
     | 'LLAMA_POOLING_TYPE_MEAN'
-    | 'LLAMA_POOLING_TYPE_CLS';
+    | 'LLAMA_POOLING_TYPE_CLS'
+    | 'LLAMA_POOLING_TYPE_LAST'
+    // for reranker models, see rerank()
+    | 'LLAMA_POOLING_TYPE_RANK';
   // context extending
   rope_scaling_type?:
     | 'LLAMA_ROPE_SCALING_TYPE_UNSPECIFIED'
@@ -97,6 +102,17 @@ export interface LoadModelConfig {
   cache_type_v?: 'f32' | 'f16' | 'q8_0' | 'q5_1' | 'q5_0' | 'q4_1' | 'q4_0';
 }
 
+export type SamplerType =
+  | 'penalties'
+  | 'dry'
+  | 'top_k'
+  | 'typ_p'
+  | 'top_p'
+  | 'min_p'
+  | 'xtc'
+  | 'temperature'
+  | 'infill';
+
 export interface SamplingConfig {
   // See sampling.h for more details
   mirostat?: number; // 0 = disabled, 1 = mirostat, 2 = mirostat 2.0
@@ -116,6 +132,16 @@ export interface SamplingConfig {
   min_p?: number;
   typical_p?: number;
   logit_bias?: { token: number; bias: number }[];
+  /**
+   * Order of samplers in the sampling chain.
+   *
+   * Default: ['top_k', 'penalties', 'dry', 'typ_p', 'top_p', 'min_p', 'xtc', 'temperature']
+   */
+  samplers_sequence?: SamplerType[];
+  /**
+   * Stop the generation when one of these strings is generated. Matching is done by the native code, the stop string is not included in the output.
+   */
+  stop_strings?: string[];
 }
 
 export interface ChatCompletionOptions {
@@ -141,6 +167,227 @@ export interface ChatCompletionOptions {
   useCache?: boolean;
 }
 
+export interface BeamSearchOptions {
+  /**
+   * Maximum number of tokens to be generated
+   */
+  nPredict: number;
+  /**
+   * Number of beams. Note: n_seq_max must be at least nBeams + 1 when loading the model.
+   *
+   * Default: nBeams = 4
+   */
+  nBeams?: number;
+  /**
+   * Number of hypotheses to be returned
+   *
+   * Default: nBest = 1
+   */
+  nBest?: number;
+  /**
+   * Score of each hypothesis is logprob / length^lengthPenalty
+   *
+   * Default: lengthPenalty = 1.0
+   */
+  lengthPenalty?: number;
+  /**
+   * List of custom token IDs for stopping the generation. EOG tokens are always included.
+   */
+  stopTokens?: number[];
+}
+
+export interface BeamSearchHypothesis {
+  tokens: number[];
+  score: number;
+  logprob: number;
+  /**
+   * false if the hypothesis reached nPredict without a stop token
+   */
+  finished: boolean;
+}
+
+/**
+ * Token attributes, returned by getVocabBinary(). Same as llama_token_attr, plus EOG.
+ */
+export const TokenAttr = {
+  UNKNOWN: 1 << 0,
+  UNUSED: 1 << 1,
+  NORMAL: 1 << 2,
+  CONTROL: 1 << 3,
+  USER_DEFINED: 1 << 4,
+  BYTE: 1 << 5,
+  NORMALIZED: 1 << 6,
+  LSTRIP: 1 << 7,
+  RSTRIP: 1 << 8,
+  SINGLE_WORD: 1 << 9,
+  EOG: 1 << 16,
+};
+
+export interface VocabBinary {
+  start: number;
+  end: number;
+  /**
+   * Bytes of all pieces, concatenated
+   */
+  pieces: Uint8Array;
+  /**
+   * end - start + 1 elements, offsets[0] is always 0
+   */
+  offsets: Int32Array;
+  /**
+   * Bitwise flags of TokenAttr
+   */
+  attrs: Int32Array;
+}
+
+export type EmbeddingFormat = 'f32' | 'f16' | 'int8' | 'binary';
+
+export interface EmbeddingOptions {
+  /**
+   * Output format, default to 'f32'
+   */
+  format?: EmbeddingFormat;
+  /**
+   * Truncate vectors to this number of dimensions (for matryoshka models), then renormalize
+   */
+  dims?: number;
+  /**
+   * -1 = none, 0 = max absolute int16, 1 = taxicab, 2 = euclidean (default)
+   */
+  normalize?: number;
+}
+
+export interface PackedEmbeddings {
+  format: EmbeddingFormat;
+  /**
+   * Number of dimensions of each vector
+   */
+  nEmbd: number;
+  /**
+   * All vectors, concatenated:
+   * - f32: Float32Array
+   * - f16: Uint16Array of raw half floats
+   * - int8: Int8Array, to be multiplied by the scale of its vector
+   * - binary: Uint8Array of sign bits (1 if positive), ceil(nEmbd / 8) bytes per vector, most significant bit first
+   */
+  data: Float32Array | Uint16Array | Int8Array | Uint8Array;
+  /**
+   * Only for int8: the scale of each vector
+   */
+  scales?: Float32Array;
+}
+
+export interface LongEmbeddingOptions {
+  /**
+   * Size of each window in tokens, default to the largest size fitting into n_ubatch
+   */
+  window?: number;
+  /**
+   * Number of tokens shared by consecutive windows, default to window / 4
+   */
+  overlap?: number;
+  /**
+   * How window vectors are combined: 'mean' (default) or 'weighted' by the number of tokens of each window
+   */
+  pooling?: 'mean' | 'weighted';
+  /**
+   * Also return the vector of each window
+   */
+  returnWindows?: boolean;
+  /**
+   * Truncate vectors to this number of dimensions (for matryoshka models)
+   */
+  dims?: number;
+}
+
+export interface LongEmbeddingResult {
+  embedding: Float32Array;
+  /**
+   * Only if returnWindows is set. Range of tokens [start, end) of each window, and its normalized vector
+   */
+  windows?: { start: number; end: number; embedding: Float32Array }[];
+}
+
+export interface VectorIndexOptions {
+  /**
+   * 'flat' for brute-force search (exact), 'hnsw' for a graph index (approximate, faster on large collections). Default to 'flat'
+   */
+  type?: 'flat' | 'hnsw';
+  /**
+   * Number of dimensions, default to n_embd of the loaded model
+   */
+  dims?: number;
+  /**
+   * HNSW only: max number of links per node, default to 16
+   */
+  m?: number;
+  /**
+   * HNSW only: size of the candidate list when inserting, default to 100
+   */
+  efConstruction?: number;
+}
+
+export interface VectorIndexSearchOptions {
+  /**
+   * Number of results, default to 10
+   */
+  k?: number;
+  /**
+   * HNSW only: size of the candidate list, larger is more accurate but slower. Default to 64
+   */
+  ef?: number;
+}
+
+export interface VectorIndexSearchResult {
+  ids: number[];
+  /**
+   * Cosine similarity
+   */
+  scores: number[];
+}
+
+/**
+ * Vectors for a vector index, either:
+ * - inputs: lists of tokens, embeddings are computed inside the engine
+ * - vectors: n x dims floats, concatenated
+ */
+export type VectorIndexData =
+  | { inputs: number[][] }
+  | { vectors: Float32Array | number[] };
+
+/**
+ * In-memory snapshot of the KV cache, see kvSnapshotExport()
+ */
+export interface KVSnapshot {
+  data: ArrayBuffer;
+  tokens: number[];
+}
+
+export interface KVSnapshotUsage {
+  maxBytes: number;
+  nBytes: number;
+  /**
+   * Names of the snapshots, most recently used first
+   */
+  names: string[];
+}
+
+export interface KVCheckpointInfo {
+  /**
+   * Size of the part written by this call
+   */
+  nBytesWritten: number;
+  /**
+   * Total size of the checkpoint chain
+   */
+  nBytes: number;
+  nParts: number;
+  /**
+   * Whether the chain was rewritten as a single full checkpoint
+   */
+  compacted: boolean;
+}
+
 export interface ModelMetadata {
   hparams: {
     nVocab: number;
@@ -163,6 +410,7 @@ export interface LoadedContextInfo {
   n_ctx: number;
   n_batch: number;
   n_ubatch: number;
+  n_seq_max: number;
   n_ctx_train: number;
   n_embd: number;
   n_layer: number;
@@ -174,6 +422,11 @@ export interface LoadedContextInfo {
   token_decoder_start: number;
   add_bos_token: boolean;
   add_eos_token: boolean;
+  /**
+   * Identify the model and the context options which change the content of the KV cache, as hex strings
+   */
+  model_fingerprint: string;
+  cparams_fingerprint: string;
 }
 
 /**
@@ -223,6 +476,9 @@ export class Wllama {
   private hasEncoder: boolean = false;
   private decoderStartToken: number = -1;
   private nCachedTokens: number = 0;
+  private promptCache: PromptCache | null = null;
+  // pending write to the prompt cache, waited for by exit()
+  private promptCacheWrite: Promise<void> = Promise.resolve();
 
   constructor(pathConfig: AssetsPathConfig, wllamaConfig: WllamaConfig = {}) {
     checkEnvironmentCompatible();
@@ -578,6 +834,151 @@ export class Wllama {
     return result;
   }
 
+  /**
+   * Calculate embedding vectors for multiple texts at once. Texts are packed together into as few llama_decode calls as possible, which is much faster than calling createEmbedding() for each text.
+   * By default, BOS and EOS tokens will be added automatically. You can use the "skipBOS" and "skipEOS" option to disable it.
+   * NOTE: this clears the KV cache
+   * @param texts Input texts
+   * @returns One embedding vector for each text
+   */
+  async createEmbeddings(
+    texts: string[],
+    options: {
+      skipBOS?: boolean;
+      skipEOS?: boolean;
+      dims?: number;
+    } = {}
+  ): Promise<Float32Array[]> {
+    this.checkModelLoaded();
+    const inputs = await this.getEmbeddingInputs(texts, options);
+    return await this.embeddingsBatch(inputs, { dims: options.dims });
+  }
+
+  /**
+   * Compute embeddings of texts and add them to a vector index, without copying the vectors out of the engine.
+   * By default, BOS and EOS tokens will be added automatically. You can use the "skipBOS" and "skipEOS" option to disable it.
+   * NOTE: this clears the KV cache
+   * @param handle Index handle returned by vectorIndexCreate()
+   * @param ids ID of each text, an existing ID is replaced
+   * @param texts
+   * @returns Number of vectors in the index
+   */
+  async vectorIndexAddTexts(
+    handle: number,
+    ids: number[],
+    texts: string[],
+    options: {
+      skipBOS?: boolean;
+      skipEOS?: boolean;
+    } = {}
+  ): Promise<number> {
+    this.checkModelLoaded();
+    const inputs = await this.getEmbeddingInputs(texts, options);
+    return await this.vectorIndexAdd(handle, ids, { inputs });
+  }
+
+  /**
+   * Find the texts most similar to a given text in a vector index
+   * @param handle Index handle returned by vectorIndexCreate()
+   * @param text
+   * @returns IDs and cosine similarity of the results, best first
+   */
+  async vectorIndexSearchText(
+    handle: number,
+    text: string,
+    options: VectorIndexSearchOptions & {
+      skipBOS?: boolean;
+      skipEOS?: boolean;
+    } = {}
+  ): Promise<VectorIndexSearchResult> {
+    this.checkModelLoaded();
+    const inputs = await this.getEmbeddingInputs([text], options);
+    const results = await this.vectorIndexSearch(handle, { inputs }, options);
+    return results[0];
+  }
+
+  /**
+   * Calculate embedding vector for a text longer than the batch size. The text is split into overlapping windows, which are embedded in batches, then combined.
+   * By default, BOS and EOS tokens will be added to each window. You can use the "skipBOS" and "skipEOS" option to disable it.
+   * NOTE: this clears the KV cache
+   * @param text Input text
+   */
+  async createLongEmbedding(
+    text: string,
+    options: LongEmbeddingOptions & {
+      skipBOS?: boolean;
+      skipEOS?: boolean;
+    } = {}
+  ): Promise<LongEmbeddingResult> {
+    this.checkModelLoaded();
+    const tokens = await this.tokenize(text);
+    return await this.embeddingsLong(tokens, {
+      ...options,
+      prefix: this.bosToken && !options.skipBOS ? [this.bosToken] : [],
+      suffix: this.eosToken && !options.skipEOS ? [this.eosToken] : [],
+    });
+  }
+
+  /**
+   * Score the relevance of documents to a query, using a reranker (cross-encoder) model.
+   * The model must be loaded with embeddings: true and pooling_type: 'LLAMA_POOLING_TYPE_RANK'.
+   * NOTE: this clears the KV cache
+   * @param query
+   * @param documents
+   * @param options.topN Only return the N best documents
+   * @returns Index of the document and its score (higher is more relevant), best first
+   */
+  async rerank(
+    query: string,
+    documents: string[],
+    options: { topN?: number } = {}
+  ): Promise<{ index: number; score: number }[]> {
+    this.checkModelLoaded();
+    const [queryTokens, ...docTokens] = await this.tokenizeBatch(
+      [query, ...documents],
+      false
+    );
+    const result = await this.proxy.wllamaAction('rerank', {
+      query: Array.from(queryTokens),
+      documents: docTokens.map((t) => Array.from(t)),
+      ...(options.topN !== undefined ? { top_n: options.topN } : {}),
+    });
+    if (result.error) {
+      throw new WllamaError(result.error);
+    } else if (!result.success) {
+      throw new WllamaError('rerank unknown error');
+    }
+    return result.results;
+  }
+
+  /**
+   * Tokenize texts and add BOS / EOS tokens for embeddings
+   */
+  private async getEmbeddingInputs(
+    texts: string[],
+    options: {
+      skipBOS?: boolean;
+      skipEOS?: boolean;
+    }
+  ): Promise<number[][]> {
+    const opt = {
+      skipBOS: false,
+      skipEOS: false,
+      ...options,
+    };
+    const tokenized = await this.tokenizeBatch(texts);
+    return tokenized.map((t) => {
+      const tokens = Array.from(t);
+      if (this.bosToken && !opt.skipBOS) {
+        tokens.unshift(this.bosToken);
+      }
+      if (this.eosToken && !opt.skipEOS) {
+        tokens.push(this.eosToken);
+      }
+      return tokens;
+    });
+  }
+
   /**
    * Make completion for a given chat messages.
    *
@@ -606,51 +1007,37 @@ export class Wllama {
     options: ChatCompletionOptions
   ): Promise<string> {
     this.checkModelLoaded();
-    this.samplingConfig = options.sampling ?? {};
-    await this.samplingInit(this.samplingConfig);
     const stopTokens = [
       this.eosToken,
       this.eotToken,
       ...(options.stopTokens ?? []),
     ];
-    // process prompt
-    let tokens = await this.tokenize(prompt, true);
-    if (this.addBosToken && tokens[0] !== this.bosToken) {
-      tokens.unshift(this.bosToken);
-    }
-    // maybe reuse KV cache
-    if (options.useCache) {
-      tokens = await this.computeNonCachedTokens(tokens);
-    } else {
-      await this.kvClear();
-    }
-    // decode/encode tokens
-    await this.samplingAccept(tokens);
-    if (this.isEncoderDecoderArchitecture()) {
-      await this.encode(tokens);
-      await this.decode([this.getDecoderStartToken()], {});
-    } else {
-      await this.decode(tokens, {});
-    }
-    let outBuf = new Uint8Array();
+    await this.processCompletionPrompt(prompt, options);
+    // text is only made of complete UTF-8 sequences, so it can be appended without re-decoding the whole output
+    let outText = '';
     // abort signal
     let abort = false;
     const abortSignal = () => {
       abort = true;
     };
+    // bytes held back by the native code (unfinished unicode, or maybe the beginning of a stop string)
+    let pendingBuf = new Uint8Array();
     // predict next tokens
     for (let i = 0; i < (options.nPredict ?? Infinity); i++) {
       const sampled = await this.samplingSample();
       if (stopTokens.includes(sampled.token)) {
         break; // stop token
       }
-      // @ts-ignore Type 'Uint8Array<ArrayBufferLike>' is not assignable to type 'Uint8Array<ArrayBuffer>'
-      outBuf = joinBuffers([outBuf, sampled.piece]);
+      outText += sampled.text;
+      pendingBuf = sampled.pending;
       if (options.onNewToken) {
-        options.onNewToken(sampled.token, sampled.piece, bufToText(outBuf), {
+        options.onNewToken(sampled.token, sampled.piece, outText, {
           abortSignal,
         });
       }
+      if (sampled.stopped) {
+        break; // stop string
+      }
       if (abort) {
         break; // abort signal is set
       }
@@ -658,74 +1045,353 @@ export class Wllama {
       await this.samplingAccept([sampled.token]);
       await this.decode([sampled.token], {});
     }
-    return bufToText(outBuf);
+    return outText + bufToText(pendingBuf);
   }
 
-  //////////////////////////////////////////////
-  // Low level API
-
   /**
-   * Create or reset the ctx_sampling
-   * @param config
-   * @param pastTokens In case re-initializing the ctx_sampling, you can re-import past tokens into the new context
+   * Make n completions for a given text. The prompt is only processed once, then all completions are generated in parallel.
+   *
+   * NOTE: n_seq_max must be at least n + 1 when loading the model.
+   *
+   * @param prompt Input text
+   * @param n Number of completions
+   * @param options onNewToken is not supported
+   * @returns List of n output completion texts
    */
-  async samplingInit(
-    config: SamplingConfig,
-    pastTokens: number[] = []
-  ): Promise<void> {
+  async createParallelCompletions(
+    prompt: string,
+    n: number,
+    options: ChatCompletionOptions
+  ): Promise<string[]> {
     this.checkModelLoaded();
-    this.samplingConfig = config;
-    const result = await this.proxy.wllamaAction('sampling_init', {
-      ...config,
-      tokens: pastTokens,
+    await this.processCompletionPrompt(prompt, options);
+    const completions = await this.generateParallel({
+      n,
+      nPredict:
+        options.nPredict ?? this.loadedContextInfo.n_ctx - this.nCachedTokens,
+      stopTokens: options.stopTokens,
     });
-    if (!result.success) {
-      throw new WllamaError('Failed to initialize sampling');
-    }
+    return completions.map((c) => bufToText(c.piece));
   }
 
   /**
-   * Get a list of pieces in vocab.
-   * NOTE: This function is slow, should only be used once.
-   * @returns A list of Uint8Array. The nth element in the list associated to nth token in vocab
-   */
-  async getVocab(): Promise<Uint8Array[]> {
-    this.checkModelLoaded();
-    const result = await this.proxy.wllamaAction('get_vocab', {});
-    return result.vocab.map((arr: number[]) => new Uint8Array(arr));
-  }
-
-  /**
-   * Lookup to see if a token exist in vocab or not. Useful for searching special tokens like "<|im_start|>"
-   * NOTE: It will match the whole token, so do not use it as a replacement for tokenize()
-   * @param piece
-   * @returns Token ID associated to the given piece. Returns -1 if cannot find the token.
+   * Make completion for a given source text, using an encoder-decoder model (for example T5 for translation).
+   * The source is encoded then the output is generated in a single call. The encoder output is kept, so calling this again with the same source (for example with another decoderPrefix or sampling config) does not encode the source again.
+   * @param source Input text for the encoder
+   * @param options onNewToken and useCache are not supported
+   * @param options.decoderPrefix Text to force at the beginning of the output
+   * @returns Output completion text (without the decoder prefix)
    */
-  async lookupToken(piece: string): Promise<number> {
+  async createSeq2SeqCompletion(
+    source: string,
+    options: ChatCompletionOptions & { decoderPrefix?: string }
+  ): Promise<string> {
     this.checkModelLoaded();
-    const result = await this.proxy.wllamaAction('lookup_token', { piece });
-    if (!result.success) {
-      return -1;
-    } else {
-      return result.token as number;
+    this.samplingConfig = options.sampling ?? {};
+    await this.samplingInit(this.samplingConfig);
+    const tokens = await this.tokenize(source, true);
+    if (this.addBosToken && tokens[0] !== this.bosToken) {
+      tokens.unshift(this.bosToken);
     }
+    const prefix = options.decoderPrefix
+      ? await this.tokenize(options.decoderPrefix, true)
+      : [];
+    const result = await this.encodeGenerate(tokens, {
+      prefix,
+      nPredict: options.nPredict ?? this.loadedContextInfo.n_ctx - prefix.length,
+      stopTokens: [
+        this.eosToken,
+        this.eotToken,
+        ...(options.stopTokens ?? []),
+      ],
+    });
+    return bufToText(result.piece);
   }
 
   /**
-   * Convert a given text to list of tokens
-   * @param text
-   * @param special Should split special tokens?
-   * @returns List of token ID
+   * Init sampling, then decode (or encode) the prompt, ready to sample the first token
    */
-  async tokenize(text: string, special: boolean = true): Promise<number[]> {
-    this.checkModelLoaded();
-    const result = await this.proxy.wllamaAction(
-      'tokenize',
-      special ? { text, special: true } : { text }
-    );
+  private async processCompletionPrompt(
+    prompt: string,
+    options: ChatCompletionOptions
+  ): Promise<void> {
+    this.samplingConfig = options.sampling ?? {};
+    await this.samplingInit(this.samplingConfig);
+    // process prompt
+    let tokens = await this.tokenize(prompt, true, !!options.useCache);
+    if (this.addBosToken && tokens[0] !== this.bosToken) {
+      tokens.unshift(this.bosToken);
+    }
+    const promptTokens = tokens;
+    const usePromptCache =
+      !!this.promptCache && !this.isEncoderDecoderArchitecture();
+    if (usePromptCache) {
+      await this.restoreFromPromptCache(tokens);
+    }
+    // maybe reuse KV cache
+    if (options.useCache || usePromptCache) {
+      tokens = await this.computeNonCachedTokens(tokens);
+    } else {
+      await this.kvClear();
+    }
+    // decode/encode tokens
+    await this.samplingAccept(tokens);
+    if (this.isEncoderDecoderArchitecture()) {
+      await this.encode(tokens);
+      await this.decode([this.getDecoderStartToken()], {});
+    } else {
+      await this.decode(tokens, {});
+    }
+    if (usePromptCache) {
+      await this.saveToPromptCache(promptTokens);
+    }
+  }
+
+  /**
+   * Enable the persistent prompt cache: the KV cache of frequently used prompt prefixes (for example a system prompt) is saved to OPFS,
+   * then restored by createCompletion() and createChatCompletion() when a prompt starts with one of them, including after the page is reloaded.
+   * Entries are only used with the same model and context options.
+   *
+   * NOTE: the model must be loaded with n_seq_max >= 2, as prefixes are saved through a scratch sequence.
+   *
+   * @param options Pass null to disable the prompt cache
+   */
+  setPromptCache(options: PromptCacheOptions | null): void {
+    this.checkModelLoaded();
+    const { model_fingerprint, cparams_fingerprint, n_seq_max } =
+      this.loadedContextInfo;
+    if (options && n_seq_max < 2) {
+      throw new WllamaError(
+        'Prompt cache requires n_seq_max >= 2 when loading the model'
+      );
+    }
+    this.promptCache = options
+      ? new PromptCache(
+          this.cacheManager,
+          `${model_fingerprint}_${cparams_fingerprint}`,
+          options
+        )
+      : null;
+  }
+
+  //////////////////////////////////////////////
+  // Low level API
+
+  /**
+   * Create or reset the ctx_sampling
+   * @param config
+   * @param pastTokens In case re-initializing the ctx_sampling, you can re-import past tokens into the new context
+   */
+  async samplingInit(
+    config: SamplingConfig,
+    pastTokens: number[] = []
+  ): Promise<void> {
+    this.checkModelLoaded();
+    this.samplingConfig = config;
+    const result = await this.proxy.wllamaAction('sampling_init', {
+      ...config,
+      tokens: pastTokens,
+    });
+    if (!result.success) {
+      throw new WllamaError('Failed to initialize sampling');
+    }
+  }
+
+  /**
+   * Get a list of pieces in vocab.
+   * @returns A list of Uint8Array. The nth element in the list associated to nth token in vocab
+   */
+  async getVocab(): Promise<Uint8Array[]> {
+    const { pieces, offsets } = await this.getVocabBinary();
+    const vocab: Uint8Array[] = [];
+    for (let i = 0; i < offsets.length - 1; i++) {
+      vocab.push(pieces.subarray(offsets[i], offsets[i + 1]));
+    }
+    return vocab;
+  }
+
+  /**
+   * Get the vocab in binary form: all pieces concatenated into one buffer, plus a table of offsets.
+   *
+   * Piece of token `start + i` is `pieces.subarray(offsets[i], offsets[i + 1])`
+   *
+   * @param range (optional) only get tokens in [start, end)
+   */
+  async getVocabBinary(
+    range: { start?: number; end?: number } = {}
+  ): Promise<VocabBinary> {
+    this.checkModelLoaded();
+    const { result, buffers } = await this.proxy.wllamaActionBin(
+      'get_vocab',
+      range
+    );
+    const offsets = new Int32Array(buffers[0]);
+    const base = offsets[0];
+    for (let i = 0; i < offsets.length; i++) {
+      offsets[i] -= base;
+    }
+    return {
+      start: result.start,
+      end: result.end,
+      pieces: new Uint8Array(buffers[2]),
+      offsets,
+      attrs: new Int32Array(buffers[1]),
+    };
+  }
+
+  /**
+   * Lookup to see if a token exist in vocab or not. Useful for searching special tokens like "<|im_start|>"
+   * NOTE: It will match the whole token, so do not use it as a replacement for tokenize()
+   * @param piece
+   * @returns Token ID associated to the given piece. Returns -1 if cannot find the token.
+   */
+  async lookupToken(piece: string): Promise<number> {
+    this.checkModelLoaded();
+    const result = await this.proxy.wllamaAction('lookup_token', { piece });
+    if (!result.success) {
+      return -1;
+    } else {
+      return result.token as number;
+    }
+  }
+
+  /**
+   * Same as lookupToken(), but lookup multiple pieces at once
+   * @param pieces
+   * @returns List of token IDs associated to the given pieces. -1 for the pieces cannot be found.
+   */
+  async lookupTokens(pieces: string[]): Promise<number[]> {
+    this.checkModelLoaded();
+    const result = await this.proxy.wllamaAction('lookup_token', { pieces });
+    return result.tokens;
+  }
+
+  /**
+   * Convert a given text to list of tokens
+   * @param text
+   * @param special Should split special tokens?
+   * @param useCache Use the tokenization cache. Tokens of a previously tokenized prefix of the text (for example, the previous turn of a conversation) will be reused when possible.
+   * @returns List of token ID
+   */
+  async tokenize(
+    text: string,
+    special: boolean = true,
+    useCache: boolean = false
+  ): Promise<number[]> {
+    this.checkModelLoaded();
+    const result = await this.proxy.wllamaAction('tokenize', {
+      text,
+      ...(special ? { special: true } : {}),
+      ...(useCache ? { use_cache: true } : {}),
+    });
     return result.tokens;
   }
 
+  /**
+   * Convert multiple texts to lists of tokens at once. On multi-thread build, texts are tokenized in parallel.
+   * @param texts
+   * @param special Should split special tokens?
+   * @returns List of tokens for each text. All lists share the same underlying buffer.
+   */
+  async tokenizeBatch(
+    texts: string[],
+    special: boolean = true
+  ): Promise<Int32Array[]> {
+    this.checkModelLoaded();
+    const { buffers } = await this.proxy.wllamaActionBin(
+      'tokenize',
+      special ? { texts, special: true } : { texts }
+    );
+    const packed = new Int32Array(buffers[0]);
+    const offsets = packed.subarray(0, texts.length + 1);
+    const tokens = packed.subarray(texts.length + 1);
+    const output: Int32Array[] = [];
+    for (let i = 0; i < texts.length; i++) {
+      output.push(tokens.subarray(offsets[i], offsets[i + 1]));
+    }
+    return output;
+  }
+
+  /**
+   * Open a session to tokenize a large text chunk by chunk, without holding the whole text nor all of its tokens in memory at once.
+   * The last word of each chunk is carried over, so that the output is the same as tokenizing the whole text (except if a word is longer than 1MB).
+   * @param special Should split special tokens?
+   * @returns a handle to be used with tokenizeStreamFeed() and tokenizeStreamClose()
+   */
+  async tokenizeStreamOpen(special: boolean = true): Promise<number> {
+    this.checkModelLoaded();
+    const result = await this.proxy.wllamaAction(
+      'tokenize_stream_open',
+      special ? { special: true } : {}
+    );
+    if (result.error) {
+      throw new WllamaError(result.error);
+    } else if (!result.success) {
+      throw new WllamaError('tokenizeStreamOpen unknown error');
+    }
+    return result.handle;
+  }
+
+  /**
+   * Feed the next chunk of text to a tokenize session
+   * @param handle
+   * @param text
+   * @param final If true, the remaining text is flushed and the session is closed
+   * @returns Tokens which are final so far (may be empty)
+   */
+  async tokenizeStreamFeed(
+    handle: number,
+    text: string,
+    final: boolean = false
+  ): Promise<Int32Array> {
+    this.checkModelLoaded();
+    const { result, buffers } = await this.proxy.wllamaActionBin(
+      'tokenize_stream_feed',
+      { handle, text, final }
+    );
+    if (result.error) {
+      throw new WllamaError(result.error);
+    } else if (!result.success) {
+      throw new WllamaError('tokenizeStreamFeed unknown error');
+    }
+    return new Int32Array(buffers[0]);
+  }
+
+  /**
+   * Close a tokenize session without flushing its remaining text
+   * @param handle
+   */
+  async tokenizeStreamClose(handle: number): Promise<void> {
+    this.checkModelLoaded();
+    const result = await this.proxy.wllamaAction('tokenize_stream_close', {
+      handle,
+    });
+    if (result.error) {
+      throw new WllamaError(result.error);
+    } else if (!result.success) {
+      throw new WllamaError('tokenizeStreamClose unknown error');
+    }
+  }
+
+  /**
+   * Count the number of tokens of multiple texts, without returning the tokens. Useful for chunk-size budgeting.
+   * @param texts
+   * @param special Should split special tokens?
+   * @returns Number of tokens for each text
+   */
+  async countTokens(
+    texts: string[],
+    special: boolean = true
+  ): Promise<number[]> {
+    this.checkModelLoaded();
+    const result = await this.proxy.wllamaAction('tokenize', {
+      texts,
+      count_only: true,
+      ...(special ? { special: true } : {}),
+    });
+    return result.counts;
+  }
+
   /**
    * Convert a list of tokens to text
    * @param tokens
@@ -737,6 +1403,28 @@ export class Wllama {
     return new Uint8Array(result.buffer);
   }
 
+  /**
+   * Convert the next tokens of a stream to text. Only complete unicode characters are returned, the unfinished ones are kept by the native code until the next call.
+   *
+   * BOS at the beginning of the stream is not rendered, and the leading space of the next token is removed if the tokenizer adds a space prefix.
+   *
+   * @param tokens New tokens of the stream
+   * @param options seqId identifies the stream (default to 0, which is also used by samplingSample); reset starts a new stream
+   * @returns The new text
+   */
+  async detokenizeStream(
+    tokens: number[],
+    options: { seqId?: number; reset?: boolean } = {}
+  ): Promise<string> {
+    this.checkModelLoaded();
+    const result = await this.proxy.wllamaAction('detokenize_stream', {
+      tokens,
+      seq_id: options.seqId ?? 0,
+      reset: !!options.reset,
+    });
+    return result.text;
+  }
+
   /**
    * Run llama_decode()
    * @param tokens A list of tokens to be decoded
@@ -855,14 +1543,28 @@ export class Wllama {
 
   /**
    * Sample a new token (remember to samplingInit() at least once before calling this function)
-   * @returns the token ID and its detokenized value (which maybe an unfinished unicode)
+   *
+   * If `stop_strings` is set in the sampling config, the piece excludes the bytes that may be the beginning of a stop string. These bytes are released by the next calls.
+   *
+   * `text` is the piece decoded incrementally: it only contains complete unicode characters, the unfinished ones are released by the next calls. All bytes held back so far are returned in `pending`.
+   *
+   * @returns the token ID and its detokenized value (which maybe an unfinished unicode); stopped is true if a stop string is found
    */
-  async samplingSample(): Promise<{ piece: Uint8Array; token: number }> {
+  async samplingSample(): Promise<{
+    piece: Uint8Array;
+    token: number;
+    text: string;
+    stopped: boolean;
+    pending: Uint8Array;
+  }> {
     this.checkModelLoaded();
     const result = await this.proxy.wllamaAction('sampling_sample', {});
     return {
       piece: new Uint8Array(result.piece),
       token: result.token,
+      text: result.text,
+      stopped: result.stopped,
+      pending: new Uint8Array(result.pending),
     };
   }
 
@@ -878,6 +1580,58 @@ export class Wllama {
     }
   }
 
+  /**
+   * Save a copy of the current ctx_sampling (RNG state, previous tokens, grammar state, etc), with the state of the stop strings and of the detokenizer used by samplingSample().
+   * Useful for branching a generation without re-accepting all past tokens.
+   * @param handle (optional) if set, clone this snapshot instead of the current ctx_sampling
+   * @returns a handle to be used with samplingRestore() and samplingSnapshotFree()
+   */
+  async samplingSnapshot(handle?: number): Promise<number> {
+    this.checkModelLoaded();
+    const result = await this.proxy.wllamaAction(
+      'sampling_snapshot',
+      handle !== undefined ? { handle } : {}
+    );
+    if (result.error) {
+      throw new WllamaError(result.error);
+    } else if (!result.success) {
+      throw new WllamaError('samplingSnapshot unknown error');
+    }
+    return result.handle;
+  }
+
+  /**
+   * Replace the current ctx_sampling with a copy of a snapshot. The snapshot is kept, so it can be restored multiple times.
+   * @param handle returned by samplingSnapshot()
+   */
+  async samplingRestore(handle: number): Promise<void> {
+    this.checkModelLoaded();
+    const result = await this.proxy.wllamaAction('sampling_restore', {
+      handle,
+    });
+    if (result.error) {
+      throw new WllamaError(result.error);
+    } else if (!result.success) {
+      throw new WllamaError('samplingRestore unknown error');
+    }
+  }
+
+  /**
+   * Free a snapshot created by samplingSnapshot()
+   * @param handle
+   */
+  async samplingSnapshotFree(handle: number): Promise<void> {
+    this.checkModelLoaded();
+    const result = await this.proxy.wllamaAction('sampling_snapshot_free', {
+      handle,
+    });
+    if (result.error) {
+      throw new WllamaError(result.error);
+    } else if (!result.success) {
+      throw new WllamaError('samplingSnapshotFree unknown error');
+    }
+  }
+
   /**
    * Get softmax-ed probability of logits, can be used for custom sampling
    * @param topK Get top K tokens having highest logits value. If topK == -1, we return all n_vocab logits, but this is not recommended because it's slow.
@@ -890,60 +1644,616 @@ export class Wllama {
   }
 
   /**
-   * Calculate embeddings for a given list of tokens. Output vector is always normalized
-   * @param tokens
-   * @returns A list of number represents an embedding vector of N dimensions
+   * Run beam search, starting from the last decoded token. All beams are decoded in the same batch at each step.
+   *
+   * The current sequence is left untouched, but its logits are no longer available after this call. To continue with a hypothesis, decode its tokens.
+   *
+   * @param options
+   * @returns List of hypotheses, sorted by descending score
    */
-  async embeddings(tokens: number[]): Promise<number[]> {
+  async beamSearch(
+    options: BeamSearchOptions
+  ): Promise<BeamSearchHypothesis[]> {
     this.checkModelLoaded();
-    if (!this.useEmbeddings) {
+    if (this.useEmbeddings) {
       throw new WllamaError(
-        'embeddings is disabled. Use wllama.setOptions({ embeddings: true }) to enable it.',
-        'inference_error'
-      );
-    }
-    if (this.nCachedTokens > 0) {
-      this.logger().warn(
-        'Embeddings: KV cache is not empty, this may produce incorrect results'
+        'embeddings is enabled. Use wllama.setOptions({ embeddings: false }) to disable it.'
       );
     }
-    if (this.nCachedTokens + tokens.length > this.loadedContextInfo.n_ctx) {
+    if (
+      this.nCachedTokens + options.nPredict >
+      this.loadedContextInfo.n_ctx
+    ) {
       throw new WllamaError(
         'Running out of context cache. Please increase n_ctx when loading the model',
         'kv_cache_full'
       );
     }
-    if (tokens.length > this.loadedContextInfo.n_batch) {
-      throw new WllamaError(
-        'Embedding tokens does not fit into batch. Please increase n_batch when loading the model',
-        'inference_error'
-      );
+    const result = await this.proxy.wllamaAction('beam_search', {
+      n_predict: options.nPredict,
+      n_beams: options.nBeams ?? 4,
+      n_best: options.nBest ?? 1,
+      length_penalty: options.lengthPenalty ?? 1.0,
+      stop_tokens: options.stopTokens ?? [],
+    });
+    if (result.error) {
+      throw new WllamaError(result.error, 'inference_error');
+    } else if (!result.success) {
+      throw new WllamaError('beamSearch unknown error');
     }
-    if (tokens.length > this.loadedContextInfo.n_ubatch) {
+    return result.hypotheses;
+  }
+
+  /**
+   * Generate n completions in parallel, starting from the last decoded token. Each completion has its own sampler (using the current sampling config, but seeded differently), all completions are decoded in the same batch at each step.
+   *
+   * The current sequence is left untouched, but its logits are no longer available after this call.
+   *
+   * NOTE: n_seq_max must be at least n + 1 when loading the model.
+   *
+   * @returns List of n completions, each has its tokens and detokenized value
+   */
+  async generateParallel(options: {
+    n: number;
+    nPredict: number;
+    stopTokens?: number[];
+  }): Promise<{ tokens: number[]; piece: Uint8Array; finished: boolean }[]> {
+    this.checkModelLoaded();
+    if (this.useEmbeddings) {
       throw new WllamaError(
-        'Embedding tokens does not fit into physical batch. Please increase n_ubatch when loading the model',
-        'inference_error'
+        'embeddings is enabled. Use wllama.setOptions({ embeddings: false }) to disable it.'
       );
     }
-    const result = await this.proxy.wllamaAction('embeddings', { tokens });
+    const result = await this.proxy.wllamaAction('generate_parallel', {
+      n: options.n,
+      n_predict: options.nPredict,
+      stop_tokens: options.stopTokens ?? [],
+    });
     if (result.error) {
-      throw new WllamaError(result.error);
+      throw new WllamaError(result.error, 'inference_error');
     } else if (!result.success) {
-      throw new WllamaError('embeddings unknown error');
-    } else {
-      return result.embeddings;
+      throw new WllamaError('generateParallel unknown error');
     }
+    return result.completions.map((c: any) => ({
+      tokens: c.tokens,
+      piece: new Uint8Array(c.buffer),
+      finished: c.finished,
+    }));
   }
 
   /**
-   * Remove and shift some tokens from KV cache.
-   * Keep n_keep, remove n_discard then shift the rest
-   * @param nKeep
-   * @param nDiscard
+   * For encoder-decoder models: encode the source tokens, then generate from the decoder start token (followed by prefix), using the sampling config of the current ctx_sampling (which is recreated first).
+   * Each call uses a new seed: `seed` if given, otherwise the previous seed + 1.
+   * The encoder output is kept, the source is not encoded again if it is the same as the last encoded one.
+   * NOTE: this clears the KV cache
+   * @param tokens Source tokens
+   * @returns Output tokens and text, whether a stop token was reached, and whether the previous encoder output was reused
    */
-  async kvRemove(nKeep: number, nDiscard: number): Promise<void> {
-    this.checkModelLoaded();
-    const result = await this.proxy.wllamaAction('kv_remove', {
+  async encodeGenerate(
+    tokens: number[],
+    options: {
+      prefix?: number[];
+      nPredict: number;
+      stopTokens?: number[];
+      seed?: number;
+    }
+  ): Promise<{
+    tokens: number[];
+    piece: Uint8Array;
+    finished: boolean;
+    reusedEncoding: boolean;
+  }> {
+    this.checkModelLoaded();
+    if (!this.hasEncoder) {
+      throw new WllamaError(
+        'This model does not use encoder-decoder architecture.',
+        'inference_error'
+      );
+    }
+    if (this.useEmbeddings) {
+      throw new WllamaError(
+        'embeddings is enabled. Use wllama.setOptions({ embeddings: false }) to disable it.',
+        'inference_error'
+      );
+    }
+    const result = await this.proxy.wllamaAction('encode_generate', {
+      tokens,
+      prefix: options.prefix ?? [],
+      n_predict: options.nPredict,
+      stop_tokens: options.stopTokens ?? [],
+      ...(options.seed !== undefined ? { seed: options.seed } : {}),
+    });
+    if (result.error) {
+      throw new WllamaError(result.error, 'inference_error');
+    } else if (!result.success) {
+      throw new WllamaError('encodeGenerate unknown error');
+    }
+    this.nCachedTokens = result.n_past;
+    return {
+      tokens: result.tokens,
+      piece: new Uint8Array(result.buffer),
+      finished: result.finished,
+      reusedEncoding: result.reused_encoding,
+    };
+  }
+
+  /**
+   * Calculate embeddings for a given list of tokens. Output vector is always normalized
+   * @param tokens
+   * @returns A list of number represents an embedding vector of N dimensions
+   */
+  async embeddings(tokens: number[]): Promise<number[]> {
+    this.checkModelLoaded();
+    if (!this.useEmbeddings) {
+      throw new WllamaError(
+        'embeddings is disabled. Use wllama.setOptions({ embeddings: true }) to enable it.',
+        'inference_error'
+      );
+    }
+    if (this.nCachedTokens > 0) {
+      this.logger().warn(
+        'Embeddings: KV cache is not empty, this may produce incorrect results'
+      );
+    }
+    if (this.nCachedTokens + tokens.length > this.loadedContextInfo.n_ctx) {
+      throw new WllamaError(
+        'Running out of context cache. Please increase n_ctx when loading the model',
+        'kv_cache_full'
+      );
+    }
+    if (tokens.length > this.loadedContextInfo.n_batch) {
+      throw new WllamaError(
+        'Embedding tokens does not fit into batch. Please increase n_batch when loading the model',
+        'inference_error'
+      );
+    }
+    if (tokens.length > this.loadedContextInfo.n_ubatch) {
+      throw new WllamaError(
+        'Embedding tokens does not fit into physical batch. Please increase n_ubatch when loading the model',
+        'inference_error'
+      );
+    }
+    const { result, buffers } = await this.proxy.wllamaActionBin(
+      'embeddings',
+      { tokens, format: 'f32' }
+    );
+    if (result.error) {
+      throw new WllamaError(result.error);
+    } else if (!result.success) {
+      throw new WllamaError('embeddings unknown error');
+    } else {
+      return Array.from(new Float32Array(buffers[0]));
+    }
+  }
+
+  /**
+   * Run embeddings for multiple lists of tokens. Lists are packed into the same batch, one sequence each, so up to n_seq_max lists (and up to n_ubatch tokens in total) are processed per llama_decode call.
+   * NOTE: this clears the KV cache
+   * @param inputs List of tokens for each input
+   * @returns One embedding vector for each input. All vectors share the same underlying buffer.
+   */
+  async embeddingsBatch(
+    inputs: number[][],
+    options: Omit<EmbeddingOptions, 'format'> = {}
+  ): Promise<Float32Array[]> {
+    const { nEmbd, data } = await this.embeddingsPacked(inputs, {
+      ...options,
+      format: 'f32',
+    });
+    const output: Float32Array[] = [];
+    for (let i = 0; i < inputs.length; i++) {
+      output.push(
+        (data as Float32Array).subarray(i * nEmbd, (i + 1) * nEmbd)
+      );
+    }
+    return output;
+  }
+
+  /**
+   * Same as embeddingsBatch(), but the vectors are returned in a compact format (converted inside the engine), ready to be stored.
+   * NOTE: this clears the KV cache
+   * @param inputs List of tokens for each input
+   * @returns All vectors, packed in the requested format
+   */
+  async embeddingsPacked(
+    inputs: number[][],
+    options: EmbeddingOptions = {}
+  ): Promise<PackedEmbeddings> {
+    this.checkModelLoaded();
+    const format = options.format ?? 'f32';
+    if (!this.useEmbeddings) {
+      throw new WllamaError(
+        'embeddings is disabled. Use wllama.setOptions({ embeddings: true }) to enable it.',
+        'inference_error'
+      );
+    }
+    const { result, buffers } = await this.proxy.wllamaActionBin(
+      'embeddings_batch',
+      {
+        inputs,
+        format,
+        dims: options.dims ?? 0,
+        normalize: options.normalize ?? 2,
+      }
+    );
+    this.nCachedTokens = 0;
+    if (result.error) {
+      throw new WllamaError(result.error);
+    } else if (!result.success) {
+      throw new WllamaError('embeddingsPacked unknown error');
+    }
+    const nEmbd: number = result.n_embd;
+    switch (format) {
+      case 'f32':
+        return { format, nEmbd, data: new Float32Array(buffers[0]) };
+      case 'f16':
+        return { format, nEmbd, data: new Uint16Array(buffers[0]) };
+      case 'int8':
+        return {
+          format,
+          nEmbd,
+          data: new Int8Array(buffers[0]),
+          scales: new Float32Array(buffers[1]),
+        };
+      case 'binary':
+        return { format, nEmbd, data: new Uint8Array(buffers[0]) };
+    }
+  }
+
+  /**
+   * Run embeddings for a list of tokens longer than the batch size, see createLongEmbedding()
+   * NOTE: this clears the KV cache
+   * @param tokens
+   * @param options.prefix Tokens added at the start of each window
+   * @param options.suffix Tokens added at the end of each window
+   */
+  async embeddingsLong(
+    tokens: number[],
+    options: LongEmbeddingOptions & {
+      prefix?: number[];
+      suffix?: number[];
+    } = {}
+  ): Promise<LongEmbeddingResult> {
+    this.checkModelLoaded();
+    if (!this.useEmbeddings) {
+      throw new WllamaError(
+        'embeddings is disabled. Use wllama.setOptions({ embeddings: true }) to enable it.',
+        'inference_error'
+      );
+    }
+    const { result, buffers } = await this.proxy.wllamaActionBin(
+      'embeddings_long',
+      {
+        tokens,
+        prefix: options.prefix ?? [],
+        suffix: options.suffix ?? [],
+        window: options.window ?? 0,
+        ...(options.overlap !== undefined ? { overlap: options.overlap } : {}),
+        pooling: options.pooling ?? 'mean',
+        return_windows: !!options.returnWindows,
+        dims: options.dims ?? 0,
+      }
+    );
+    this.nCachedTokens = 0;
+    if (result.error) {
+      throw new WllamaError(result.error);
+    } else if (!result.success) {
+      throw new WllamaError('embeddingsLong unknown error');
+    }
+    const nEmbd: number = result.n_embd;
+    const packed = new Float32Array(buffers[0]);
+    const output: LongEmbeddingResult = {
+      embedding: packed.subarray(0, nEmbd),
+    };
+    if (options.returnWindows) {
+      output.windows = (result.windows as [number, number][]).map(
+        ([start, end], i) => ({
+          start,
+          end,
+          embedding: packed.subarray((i + 1) * nEmbd, (i + 2) * nEmbd),
+        })
+      );
+    }
+    return output;
+  }
+
+  /**
+   * Get the embedding of every token, for late-interaction retrieval (ColBERT-style) or span extraction.
+   * The model must be loaded with embeddings: true and pooling_type: 'LLAMA_POOLING_TYPE_NONE'.
+   * NOTE: this clears the KV cache
+   * @param tokens
+   * @param options.project Apply the projection set by setEmbeddingsProjection() instead of truncating to options.dims
+   * @returns nTokens vectors, packed in the requested format
+   */
+  async embeddingsTokens(
+    tokens: number[],
+    options: EmbeddingOptions & { project?: boolean } = {}
+  ): Promise<PackedEmbeddings & { nTokens: number }> {
+    this.checkModelLoaded();
+    const format = options.format ?? 'f32';
+    const { result, buffers } = await this.proxy.wllamaActionBin(
+      'embeddings_tokens',
+      {
+        tokens,
+        format,
+        dims: options.dims ?? 0,
+        normalize: options.normalize ?? 2,
+        project: !!options.project,
+      }
+    );
+    this.nCachedTokens = 0;
+    if (result.error) {
+      throw new WllamaError(result.error);
+    } else if (!result.success) {
+      throw new WllamaError('embeddingsTokens unknown error');
+    }
+    const nEmbd: number = result.n_embd;
+    const nTokens: number = result.n_tokens;
+    switch (format) {
+      case 'f32':
+        return { format, nEmbd, nTokens, data: new Float32Array(buffers[0]) };
+      case 'f16':
+        return { format, nEmbd, nTokens, data: new Uint16Array(buffers[0]) };
+      case 'int8':
+        return {
+          format,
+          nEmbd,
+          nTokens,
+          data: new Int8Array(buffers[0]),
+          scales: new Float32Array(buffers[1]),
+        };
+      case 'binary':
+        return { format, nEmbd, nTokens, data: new Uint8Array(buffers[0]) };
+    }
+  }
+
+  /**
+   * Set a linear projection for embeddingsTokens(), for example the projection layer of a ColBERT model.
+   * The projection is removed when the model is unloaded.
+   * @param matrix Row-major, dims rows of n_embd values. Set to null to remove the projection.
+   * @param dims Number of output dimensions
+   */
+  async setEmbeddingsProjection(
+    matrix: Float32Array | number[] | null,
+    dims: number = 0
+  ): Promise<void> {
+    this.checkModelLoaded();
+    const result = await this.proxy.wllamaAction('embeddings_set_projection', {
+      matrix: matrix ? Array.from(matrix) : [],
+      dims,
+    });
+    if (result.error) {
+      throw new WllamaError(result.error);
+    } else if (!result.success) {
+      throw new WllamaError('setEmbeddingsProjection unknown error');
+    }
+  }
+
+  /**
+   * Configure the embeddings cache. Embeddings are cached by their input tokens (and the pooling type), so that re-embedding the same input does not run the model again.
+   * The cache is disabled by default, and cleared when the model is unloaded.
+   * @param maxBytes Maximum size of the cache in bytes, least recently used entries are evicted first. Set to 0 to disable the cache.
+   * @returns Current usage of the cache
+   */
+  async setEmbeddingsCache(
+    maxBytes: number
+  ): Promise<{ nEntries: number; nBytes: number }> {
+    this.checkModelLoaded();
+    const result = await this.proxy.wllamaAction('embeddings_cache_config', {
+      max_bytes: maxBytes,
+    });
+    if (!result.success) {
+      throw new WllamaError('setEmbeddingsCache unknown error');
+    }
+    return { nEntries: result.n_entries, nBytes: result.n_bytes };
+  }
+
+  /**
+   * Save the embeddings cache to file (virtual file system). The file can only be loaded with the same model.
+   * @param filePath
+   * @returns Number of saved entries
+   */
+  async embeddingsCacheSave(filePath: string): Promise<number> {
+    this.checkModelLoaded();
+    const result = await this.proxy.wllamaAction('embeddings_cache_save', {
+      path: filePath,
+    });
+    if (result.error) {
+      throw new WllamaError(result.error);
+    } else if (!result.success) {
+      throw new WllamaError('embeddingsCacheSave unknown error');
+    }
+    return result.n_entries;
+  }
+
+  /**
+   * Load entries into the embeddings cache from file (virtual file system). The cache must be enabled via setEmbeddingsCache() first.
+   * @param filePath
+   * @returns Number of entries in the cache after loading
+   */
+  async embeddingsCacheLoad(filePath: string): Promise<number> {
+    this.checkModelLoaded();
+    const result = await this.proxy.wllamaAction('embeddings_cache_load', {
+      path: filePath,
+    });
+    if (result.error) {
+      throw new WllamaError(result.error);
+    } else if (!result.success) {
+      throw new WllamaError('embeddingsCacheLoad unknown error');
+    }
+    return result.n_entries;
+  }
+
+  /**
+   * Create a vector index inside the engine, to search embeddings by cosine similarity.
+   * Indexes are kept when the model is unloaded, free them with vectorIndexFree().
+   * @returns a handle to be used with other vectorIndex*() functions
+   */
+  async vectorIndexCreate(options: VectorIndexOptions = {}): Promise<number> {
+    this.checkModelLoaded();
+    const result = await this.proxy.wllamaAction('vector_index_create', {
+      type: options.type ?? 'flat',
+      ...(options.dims ? { dims: options.dims } : {}),
+      ...(options.m ? { m: options.m } : {}),
+      ...(options.efConstruction
+        ? { ef_construction: options.efConstruction }
+        : {}),
+    });
+    if (result.error) {
+      throw new WllamaError(result.error);
+    } else if (!result.success) {
+      throw new WllamaError('vectorIndexCreate unknown error');
+    }
+    return result.handle;
+  }
+
+  /**
+   * Add vectors to an index. Vectors are normalized before being added.
+   * NOTE: if "inputs" is used, this clears the KV cache
+   * @param handle
+   * @param ids ID of each vector, an existing ID is replaced
+   * @param data
+   * @returns Number of vectors in the index
+   */
+  async vectorIndexAdd(
+    handle: number,
+    ids: number[],
+    data: VectorIndexData
+  ): Promise<number> {
+    this.checkModelLoaded();
+    const result = await this.proxy.wllamaAction('vector_index_add', {
+      handle,
+      ids,
+      ...this.getVectorIndexData(data),
+    });
+    if (result.error) {
+      throw new WllamaError(result.error);
+    } else if (!result.success) {
+      throw new WllamaError('vectorIndexAdd unknown error');
+    }
+    return result.n_vectors;
+  }
+
+  /**
+   * Find the most similar vectors for each query
+   * NOTE: if "inputs" is used, this clears the KV cache
+   * @param handle
+   * @param queries
+   * @returns IDs and cosine similarity of the results for each query, best first
+   */
+  async vectorIndexSearch(
+    handle: number,
+    queries: VectorIndexData,
+    options: VectorIndexSearchOptions = {}
+  ): Promise<VectorIndexSearchResult[]> {
+    this.checkModelLoaded();
+    const result = await this.proxy.wllamaAction('vector_index_search', {
+      handle,
+      k: options.k ?? 10,
+      ef: options.ef ?? 64,
+      ...this.getVectorIndexData(queries),
+    });
+    if (result.error) {
+      throw new WllamaError(result.error);
+    } else if (!result.success) {
+      throw new WllamaError('vectorIndexSearch unknown error');
+    }
+    return result.results;
+  }
+
+  /**
+   * Remove vectors from an index
+   * @param handle
+   * @param ids
+   * @returns Number of vectors in the index
+   */
+  async vectorIndexRemove(handle: number, ids: number[]): Promise<number> {
+    this.checkModelLoaded();
+    const result = await this.proxy.wllamaAction('vector_index_remove', {
+      handle,
+      ids,
+    });
+    if (result.error) {
+      throw new WllamaError(result.error);
+    } else if (!result.success) {
+      throw new WllamaError('vectorIndexRemove unknown error');
+    }
+    return result.n_vectors;
+  }
+
+  /**
+   * Save an index to file (virtual file system)
+   * @param handle
+   * @param filePath
+   */
+  async vectorIndexSave(handle: number, filePath: string): Promise<void> {
+    this.checkModelLoaded();
+    const result = await this.proxy.wllamaAction('vector_index_save', {
+      handle,
+      path: filePath,
+    });
+    if (result.error) {
+      throw new WllamaError(result.error);
+    } else if (!result.success) {
+      throw new WllamaError('vectorIndexSave unknown error');
+    }
+  }
+
+  /**
+   * Load an index from file (virtual file system)
+   * @param filePath
+   * @returns a new handle, the number of dimensions and the number of vectors of the index
+   */
+  async vectorIndexLoad(
+    filePath: string
+  ): Promise<{ handle: number; dims: number; nVectors: number }> {
+    this.checkModelLoaded();
+    const result = await this.proxy.wllamaAction('vector_index_load', {
+      path: filePath,
+    });
+    if (result.error) {
+      throw new WllamaError(result.error);
+    } else if (!result.success) {
+      throw new WllamaError('vectorIndexLoad unknown error');
+    }
+    return {
+      handle: result.handle,
+      dims: result.dims,
+      nVectors: result.n_vectors,
+    };
+  }
+
+  /**
+   * Free an index
+   * @param handle
+   */
+  async vectorIndexFree(handle: number): Promise<void> {
+    this.checkModelLoaded();
+    const result = await this.proxy.wllamaAction('vector_index_free', {
+      handle,
+    });
+    if (result.error) {
+      throw new WllamaError(result.error);
+    } else if (!result.success) {
+      throw new WllamaError('vectorIndexFree unknown error');
+    }
+  }
+
+  private getVectorIndexData(data: VectorIndexData) {
+    return 'inputs' in data
+      ? { inputs: data.inputs }
+      : { vectors: Array.from(data.vectors) };
+  }
+
+  /**
+   * Remove and shift some tokens from KV cache.
+   * Keep n_keep, remove n_discard then shift the rest
+   * @param nKeep
+   * @param nDiscard
+   */
+  async kvRemove(nKeep: number, nDiscard: number): Promise<void> {
+    this.checkModelLoaded();
+    const result = await this.proxy.wllamaAction('kv_remove', {
       n_keep: nKeep,
       n_discard: nDiscard,
     });
@@ -966,21 +2276,65 @@ export class Wllama {
   }
 
   /**
-   * Save session to file (virtual file system)
+   * Save session to file (virtual file system).
+   * The file contains the cached tokens and the KV cache, compressed unless `compress` is false.
+   * It can only be loaded with the same model, KV cache types and RoPE params.
+   * The KV cache is split in chunks of about `chunkSize` bytes (default to 16MB), loading a session only holds one chunk in memory at a time.
+   * Splitting requires n_seq_max >= 2, otherwise the KV cache is written as a single chunk.
    * TODO: add ability to download the file
    * @param filePath
    * @returns List of tokens saved to the file
    */
-  async sessionSave(filePath: string): Promise<{ tokens: number[] }> {
+  async sessionSave(
+    filePath: string,
+    options: { compress?: boolean; chunkSize?: number } = {}
+  ): Promise<{ tokens: number[]; nBytes: number }> {
     this.checkModelLoaded();
     const result = await this.proxy.wllamaAction('session_save', {
       session_path: filePath,
+      compress: options.compress ?? true,
+      ...(options.chunkSize ? { chunk_size: options.chunkSize } : {}),
     });
-    return result;
+    if (result.error) {
+      throw new WllamaError(result.error);
+    } else if (!result.success) {
+      throw new WllamaError('sessionSave unknown error');
+    }
+    return { tokens: result.tokens, nBytes: result.n_bytes };
   }
 
   /**
-   * Load session from file (virtual file system)
+   * Same as sessionSave(), but the session is returned instead of being written to a file.
+   * It can be loaded back with sessionLoadFromStream().
+   * `nTokens` limits the export to the first cached tokens, it requires n_seq_max >= 2 (otherwise an error is thrown).
+   */
+  async sessionExport(
+    options: { compress?: boolean; chunkSize?: number; nTokens?: number } = {}
+  ): Promise<{ data: ArrayBuffer; tokens: number[]; nChunks: number }> {
+    this.checkModelLoaded();
+    const { result, buffers } = await this.proxy.wllamaActionBin(
+      'session_export',
+      {
+        compress: options.compress ?? true,
+        ...(options.chunkSize ? { chunk_size: options.chunkSize } : {}),
+        ...(options.nTokens !== undefined ? { n_tokens: options.nTokens } : {}),
+      }
+    );
+    if (result.error) {
+      throw new WllamaError(result.error);
+    } else if (!result.success) {
+      throw new WllamaError('sessionExport unknown error');
+    }
+    return {
+      data: buffers[0],
+      tokens: result.tokens,
+      nChunks: result.n_chunks,
+    };
+  }
+
+  /**
+   * Load session from file (virtual file system), replacing the current KV cache.
+   * Throws if the file was saved with a different model or context options.
    * TODO: add ability to download the file
    * @param filePath
    */
@@ -994,8 +2348,230 @@ export class Wllama {
     } else if (!result.success) {
       throw new WllamaError('sessionLoad unknown error');
     }
-    const cachedTokens = await this.getCachedTokens();
-    this.nCachedTokens = cachedTokens.length;
+    this.nCachedTokens = result.n_past;
+  }
+
+  /**
+   * Load a session file created by sessionSave() from a Blob or a stream, replacing the current KV cache.
+   * The content is passed to the engine piece by piece, so it never needs to be fully copied into the engine's memory.
+   * @param source
+   */
+  async sessionLoadFromStream(
+    source: Blob | ReadableStream<Uint8Array>
+  ): Promise<void> {
+    this.checkModelLoaded();
+    const stream = source instanceof Blob ? source.stream() : source;
+    const reader = stream.getReader();
+    this.nCachedTokens = 0;
+    await this.proxy.wllamaAction('session_load_begin', {});
+    try {
+      let done = false;
+      while (!done) {
+        let chunk: ReadableStreamReadResult<Uint8Array>;
+        try {
+          chunk = await reader.read();
+        } catch (e) {
+          // cancel the load, the partially restored KV cache is cleared
+          await this.proxy.wllamaAction('session_load_feed', { final: true });
+          throw e;
+        }
+        done = chunk.done;
+        const inputs = chunk.value ? [chunk.value.slice().buffer] : [];
+        const { result } = await this.proxy.wllamaActionBin(
+          'session_load_feed',
+          { final: done },
+          inputs
+        );
+        if (result.error) {
+          throw new WllamaError(result.error);
+        } else if (!result.success) {
+          throw new WllamaError('sessionLoadFromStream unknown error');
+        }
+        if (done) {
+          this.nCachedTokens = result.n_past;
+        }
+      }
+    } finally {
+      reader.releaseLock();
+    }
+  }
+
+  /**
+   * Save the KV cache and the cached tokens into a named in-memory snapshot, replacing any snapshot with the same name.
+   * This is much cheaper than sessionSave(), as nothing goes through the file system.
+   * Older snapshots are evicted when the budget set by setKVSnapshotBudget() is exceeded.
+   * @param name
+   * @returns Size of the snapshot in bytes
+   */
+  async kvSnapshotSave(name: string): Promise<number> {
+    this.checkModelLoaded();
+    const result = await this.proxy.wllamaAction('kv_snapshot_save', {
+      name,
+    });
+    if (result.error) {
+      throw new WllamaError(result.error);
+    } else if (!result.success) {
+      throw new WllamaError('kvSnapshotSave unknown error');
+    }
+    return result.n_bytes;
+  }
+
+  /**
+   * Restore a snapshot saved by kvSnapshotSave() or added by kvSnapshotImport(), replacing the current KV cache
+   * @param name
+   */
+  async kvSnapshotLoad(name: string): Promise<void> {
+    this.checkModelLoaded();
+    const result = await this.proxy.wllamaAction('kv_snapshot_load', {
+      name,
+    });
+    if (result.error) {
+      this.nCachedTokens = 0;
+      throw new WllamaError(result.error);
+    } else if (!result.success) {
+      throw new WllamaError('kvSnapshotLoad unknown error');
+    }
+    this.nCachedTokens = result.n_past;
+  }
+
+  /**
+   * Delete a snapshot
+   * @param name
+   * @returns false if the snapshot does not exist
+   */
+  async kvSnapshotDelete(name: string): Promise<boolean> {
+    this.checkModelLoaded();
+    const result = await this.proxy.wllamaAction('kv_snapshot_delete', {
+      name,
+    });
+    if (!result.success) {
+      throw new WllamaError('kvSnapshotDelete unknown error');
+    }
+    return result.deleted;
+  }
+
+  /**
+   * Set the memory budget of the snapshots (default to 256MB), least recently used ones are evicted first.
+   * Snapshots are dropped when the model is unloaded.
+   * @param maxBytes If not given, only returns the current usage
+   */
+  async setKVSnapshotBudget(maxBytes?: number): Promise<KVSnapshotUsage> {
+    this.checkModelLoaded();
+    const result = await this.proxy.wllamaAction(
+      'kv_snapshot_config',
+      maxBytes === undefined ? {} : { max_bytes: maxBytes }
+    );
+    if (!result.success) {
+      throw new WllamaError('setKVSnapshotBudget unknown error');
+    }
+    return {
+      maxBytes: result.max_bytes,
+      nBytes: result.n_bytes,
+      names: result.names,
+    };
+  }
+
+  /**
+   * Copy a snapshot out of the engine, for example to persist it. The data is only valid for the same model and context options.
+   * @param name
+   */
+  async kvSnapshotExport(name: string): Promise<KVSnapshot> {
+    this.checkModelLoaded();
+    const { result, buffers } = await this.proxy.wllamaActionBin(
+      'kv_snapshot_export',
+      { name }
+    );
+    if (result.error) {
+      throw new WllamaError(result.error);
+    } else if (!result.success) {
+      throw new WllamaError('kvSnapshotExport unknown error');
+    }
+    return {
+      data: buffers[0],
+      tokens: result.tokens,
+    };
+  }
+
+  /**
+   * Add a snapshot previously returned by kvSnapshotExport(), it can then be restored with kvSnapshotLoad()
+   * @param name
+   * @param snapshot
+   */
+  async kvSnapshotImport(name: string, snapshot: KVSnapshot): Promise<void> {
+    this.checkModelLoaded();
+    const { result } = await this.proxy.wllamaActionBin(
+      'kv_snapshot_import',
+      { name, tokens: snapshot.tokens },
+      [snapshot.data]
+    );
+    if (result.error) {
+      throw new WllamaError(result.error);
+    } else if (!result.success) {
+      throw new WllamaError('kvSnapshotImport unknown error');
+    }
+  }
+
+  /**
+   * Save an incremental checkpoint of the KV cache. If the cached tokens extend the ones of the previous checkpoint with the same name,
+   * only the new positions are saved, so the cost is proportional to the number of new tokens.
+   * The chain is compacted into a single full checkpoint once it has `maxParts` parts, or when the cached tokens diverged.
+   * Requires n_seq_max >= 2, the last sequence is used as scratch.
+   * @param name
+   */
+  async kvCheckpointSave(
+    name: string,
+    options: { maxParts?: number } = {}
+  ): Promise<KVCheckpointInfo> {
+    this.checkModelLoaded();
+    const result = await this.proxy.wllamaAction('kv_checkpoint_save', {
+      name,
+      ...(options.maxParts ? { max_parts: options.maxParts } : {}),
+    });
+    if (result.error) {
+      throw new WllamaError(result.error);
+    } else if (!result.success) {
+      throw new WllamaError('kvCheckpointSave unknown error');
+    }
+    return {
+      nBytesWritten: result.n_bytes_written,
+      nBytes: result.n_bytes,
+      nParts: result.n_parts,
+      compacted: result.compacted,
+    };
+  }
+
+  /**
+   * Restore a checkpoint saved by kvCheckpointSave(), replacing the current KV cache
+   * @param name
+   */
+  async kvCheckpointLoad(name: string): Promise<void> {
+    this.checkModelLoaded();
+    const result = await this.proxy.wllamaAction('kv_checkpoint_load', {
+      name,
+    });
+    if (result.error) {
+      this.nCachedTokens = 0;
+      throw new WllamaError(result.error);
+    } else if (!result.success) {
+      throw new WllamaError('kvCheckpointLoad unknown error');
+    }
+    this.nCachedTokens = result.n_past;
+  }
+
+  /**
+   * Delete a checkpoint and all its parts
+   * @param name
+   * @returns false if the checkpoint does not exist
+   */
+  async kvCheckpointDelete(name: string): Promise<boolean> {
+    this.checkModelLoaded();
+    const result = await this.proxy.wllamaAction('kv_checkpoint_delete', {
+      name,
+    });
+    if (!result.success) {
+      throw new WllamaError('kvCheckpointDelete unknown error');
+    }
+    return result.deleted;
   }
 
   /**
@@ -1040,6 +2616,8 @@ export class Wllama {
    * Note: This function will NOT crash if model is not yet loaded
    */
   async exit(): Promise<void> {
+    await this.promptCacheWrite;
+    this.promptCache = null;
     await this.proxy?.wllamaExit();
     this.proxy = null as any;
   }
@@ -1079,5 +2657,47 @@ export class Wllama {
     return seq.slice(nKeep, seq.length);
   }
 
+  /**
+   * Restore the longest prefix of the tokens found in the prompt cache, if it is longer than what the KV cache already holds
+   */
+  private async restoreFromPromptCache(tokens: number[]) {
+    const cachedTokens = await this.getCachedTokens();
+    let nKeep = 0;
+    for (; nKeep < Math.min(cachedTokens.length, tokens.length); nKeep++) {
+      if (cachedTokens[nKeep] !== tokens[nKeep]) {
+        break;
+      }
+    }
+    const found = await this.promptCache!.findLongest(tokens, nKeep);
+    if (!found) {
+      return;
+    }
+    try {
+      await this.sessionLoadFromStream(found.blob);
+      this.logger().debug(`Prompt cache hit nTokens=${found.nTokens}`);
+    } catch (e) {
+      // for example, the entry is corrupted
+      this.logger().warn('Cannot restore prompt cache entry, deleting it', e);
+      await this.promptCache!.delete(found.key);
+      await this.kvClear();
+    }
+  }
+
+  /**
+   * Count the prompt in the prompt cache, and save its KV cache if one of its prefixes became frequently used
+   */
+  private async saveToPromptCache(tokens: number[]) {
+    const promptCache = this.promptCache!;
+    const prefix = promptCache.recordPrompt(tokens);
+    if (!prefix) {
+      return;
+    }
+    const { data } = await this.sessionExport({ nTokens: prefix.nTokens });
+    // written in the background, so that it does not delay the generation
+    this.promptCacheWrite = this.promptCacheWrite
+      .then(() => promptCache.save(prefix.key, new Blob([data])))
+      .catch((e) => this.logger().warn('Cannot write prompt cache entry', e));
+  }
+
   // TODO: add current_status
 }
@@ -33,6 +33,7 @@ interface TaskParam {
     | 'fs.write'
     | 'wllama.start'
     | 'wllama.action'
+    | 'wllama.action_bin'
     | 'wllama.exit'
     | 'wllama.debug';
   args: any[];
@@ -138,6 +139,23 @@ export class ProxyToWorker {
     return parsedResult;
   }
 
+  /**
+   * Same as wllamaAction(), but also returns the binary buffers listed by the cpp code in "__buffers"
+   * @param inputs Binary buffers to be copied into the heap, the cpp code receives their location in "__in_buffers"
+   */
+  async wllamaActionBin(
+    name: string,
+    body: any,
+    inputs: ArrayBuffer[] = []
+  ): Promise<{ result: any; buffers: ArrayBuffer[] }> {
+    const { json, buffers } = await this.pushTask({
+      verb: 'wllama.action_bin',
+      args: [name, JSON.stringify(body), inputs],
+      callbackId: this.taskId++,
+    });
+    return { result: this.parseResult(json), buffers };
+  }
+
   async wllamaExit(): Promise<void> {
     if (this.worker) {
       const result = await this.pushTask({
@@ -11,7 +11,7 @@ let Module = null;
 //////////////////////////////////////////////////////////////
 
 // send message back to main thread
-const msg = (data) => postMessage(data);
+const msg = (data, transfer) => postMessage(data, transfer);
 
 // Convert CPP log into JS log
 const cppLogToJSLog = (line) => {
@@ -340,6 +340,44 @@ onmessage = async (e) => {
     return;
   }
 
+  if (verb === 'wllama.action_bin') {
+    // same as wllama.action, but the result also lists memory regions to be copied out of the heap
+    // the regions are only valid until the next call to cpp code, so they are copied right away
+    // optional input buffers are copied into a heap region allocated by cpp code, their offsets are passed in "__in_buffers"
+    const argAction = args[0];
+    let argBody = args[1];
+    const argInputs = args[2] || [];
+    try {
+      if (argInputs.length > 0) {
+        const totalSize = argInputs.reduce((acc, b) => acc + b.byteLength, 0);
+        const alloc = JSON.parse(
+          await wllamaAction('alloc_in_buf', JSON.stringify({ size: totalSize }))
+        );
+        const [ptr] = alloc.region;
+        const inBuffers = [];
+        let offset = 0;
+        for (const b of argInputs) {
+          Module.HEAPU8.set(new Uint8Array(b), ptr + offset);
+          inBuffers.push([offset, b.byteLength]);
+          offset += b.byteLength;
+        }
+        argBody = JSON.stringify({
+          ...JSON.parse(argBody),
+          __in_buffers: inBuffers,
+        });
+      }
+      const json = await wllamaAction(argAction, argBody);
+      const regions = JSON.parse(json).__buffers || [];
+      const buffers = regions.map(
+        ([ptr, size]) => Module.HEAPU8.slice(ptr, ptr + size).buffer
+      );
+      msg({ callbackId, result: { json, buffers } }, buffers);
+    } catch (err) {
+      msg({ callbackId, err });
+    }
+    return;
+  }
+
   if (verb === 'wllama.exit') {
     try {
       const result = await wllamaExit();
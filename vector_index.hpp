@@ -0,0 +1,416 @@
+#pragma once
+
+#include <vector>
+#include <queue>
+#include <random>
+#include <unordered_map>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdint>
+
+#if defined(__wasm_simd128__)
+#include <wasm_simd128.h>
+#elif defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+// dot product of two vectors; vectors in the index are normalized, so this is the cosine similarity
+inline static float vec_dot(const float *a, const float *b, size_t n)
+{
+  size_t i = 0;
+  float sum = 0.0f;
+#if defined(__wasm_simd128__)
+  v128_t acc0 = wasm_f32x4_splat(0.0f);
+  v128_t acc1 = wasm_f32x4_splat(0.0f);
+  for (; i + 8 <= n; i += 8)
+  {
+    acc0 = wasm_f32x4_add(acc0, wasm_f32x4_mul(wasm_v128_load(a + i), wasm_v128_load(b + i)));
+    acc1 = wasm_f32x4_add(acc1, wasm_f32x4_mul(wasm_v128_load(a + i + 4), wasm_v128_load(b + i + 4)));
+  }
+  acc0 = wasm_f32x4_add(acc0, acc1);
+  sum = wasm_f32x4_extract_lane(acc0, 0) + wasm_f32x4_extract_lane(acc0, 1) + wasm_f32x4_extract_lane(acc0, 2) + wasm_f32x4_extract_lane(acc0, 3);
+#elif defined(__AVX2__)
+  __m256 acc = _mm256_setzero_ps();
+  for (; i + 8 <= n; i += 8)
+  {
+    acc = _mm256_add_ps(acc, _mm256_mul_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i)));
+  }
+  __m128 s = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+  s = _mm_hadd_ps(s, s);
+  s = _mm_hadd_ps(s, s);
+  sum = _mm_cvtss_f32(s);
+#endif
+  for (; i < n; i++)
+  {
+    sum += a[i] * b[i];
+  }
+  return sum;
+}
+
+#define VECTOR_INDEX_FILE_MAGIC 0x49564c57 // "WLVI"
+#define VECTOR_INDEX_FILE_VERSION 1
+
+// index of normalized vectors, searched by cosine similarity
+// - FLAT: brute-force scan, exact
+// - HNSW: hierarchical navigable small world graph, approximate but sub-linear
+// removed vectors are only marked as deleted: in a HNSW graph, they are still used for routing but never returned
+struct vector_index
+{
+  enum index_type
+  {
+    FLAT = 0,
+    HNSW = 1,
+  };
+  typedef std::pair<float, uint32_t> scored; // (similarity, node)
+
+  index_type type = FLAT;
+  uint32_t n_dims = 0;
+  uint32_t M = 16; // max number of links per node, 2 * M on level 0
+  uint32_t ef_construction = 100;
+  uint32_t n_alive = 0;
+  std::vector<float> data; // n_dims floats per node
+  std::vector<int64_t> ids;
+  std::vector<uint8_t> deleted;
+  std::vector<std::vector<std::vector<uint32_t>>> links; // links[node][level], HNSW only
+  std::unordered_map<int64_t, uint32_t> id_to_node;
+  int32_t entry_point = -1;
+  int32_t max_level = -1;
+  std::mt19937 rng{42};
+
+  const float *vec(uint32_t node) const
+  {
+    return data.data() + (size_t)node * n_dims;
+  }
+
+  // add a normalized vector, an existing id is replaced
+  void add(int64_t id, const float *v)
+  {
+    remove(id);
+    uint32_t node = ids.size();
+    data.insert(data.end(), v, v + n_dims);
+    ids.push_back(id);
+    deleted.push_back(0);
+    id_to_node[id] = node;
+    n_alive++;
+    if (type == HNSW)
+    {
+      insert_hnsw(node);
+    }
+  }
+
+  bool remove(int64_t id)
+  {
+    auto it = id_to_node.find(id);
+    if (it == id_to_node.end())
+    {
+      return false;
+    }
+    deleted[it->second] = 1;
+    id_to_node.erase(it);
+    n_alive--;
+    return true;
+  }
+
+  // find the k most similar vectors, best first; ef is the size of the HNSW candidate list
+  std::vector<std::pair<float, int64_t>> search(const float *q, size_t k, size_t ef) const
+  {
+    std::vector<scored> found;
+    if (k == 0)
+    {
+      return {};
+    }
+    if (type == FLAT)
+    {
+      // keep the k best in a min-heap
+      std::priority_queue<scored, std::vector<scored>, std::greater<scored>> best;
+      for (uint32_t node = 0; node < ids.size(); node++)
+      {
+        if (deleted[node])
+        {
+          continue;
+        }
+        float s = vec_dot(q, vec(node), n_dims);
+        if (best.size() < k)
+        {
+          best.push({s, node});
+        }
+        else if (s > best.top().first)
+        {
+          best.pop();
+          best.push({s, node});
+        }
+      }
+      for (; !best.empty(); best.pop())
+      {
+        found.push_back(best.top());
+      }
+    }
+    else if (entry_point >= 0)
+    {
+      uint32_t ep = entry_point;
+      for (int32_t lc = max_level; lc > 0; lc--)
+      {
+        ep = search_layer(q, ep, 1, lc)[0].second;
+      }
+      found = search_layer(q, ep, std::max(ef, k), 0);
+    }
+    std::sort(found.begin(), found.end(), std::greater<scored>());
+    std::vector<std::pair<float, int64_t>> output;
+    for (auto &f : found)
+    {
+      if (output.size() == k)
+      {
+        break;
+      }
+      if (!deleted[f.second])
+      {
+        output.push_back({f.first, ids[f.second]});
+      }
+    }
+    return output;
+  }
+
+  bool save(FILE *f) const
+  {
+    uint32_t header[6] = {VECTOR_INDEX_FILE_MAGIC, VECTOR_INDEX_FILE_VERSION, (uint32_t)type, n_dims, M, ef_construction};
+    uint32_t n_nodes = ids.size();
+    int32_t ep[2] = {entry_point, max_level};
+    fwrite(header, sizeof(header), 1, f);
+    fwrite(&n_nodes, sizeof(n_nodes), 1, f);
+    fwrite(ep, sizeof(ep), 1, f);
+    fwrite(ids.data(), sizeof(int64_t), n_nodes, f);
+    fwrite(deleted.data(), sizeof(uint8_t), n_nodes, f);
+    fwrite(data.data(), sizeof(float), data.size(), f);
+    if (type == HNSW)
+    {
+      for (auto &node_links : links)
+      {
+        uint32_t n_levels = node_links.size();
+        fwrite(&n_levels, sizeof(n_levels), 1, f);
+        for (auto &l : node_links)
+        {
+          uint32_t n = l.size();
+          fwrite(&n, sizeof(n), 1, f);
+          fwrite(l.data(), sizeof(uint32_t), n, f);
+        }
+      }
+    }
+    return !ferror(f);
+  }
+
+  // return false if the file is invalid, in which case the index is left in an unspecified state
+  bool load(FILE *f)
+  {
+    uint32_t header[6];
+    uint32_t n_nodes;
+    int32_t ep[2];
+    if (fread(header, sizeof(header), 1, f) != 1 || header[0] != VECTOR_INDEX_FILE_MAGIC || header[1] != VECTOR_INDEX_FILE_VERSION || header[2] > HNSW || header[3] == 0 || fread(&n_nodes, sizeof(n_nodes), 1, f) != 1 || fread(ep, sizeof(ep), 1, f) != 1)
+    {
+      return false;
+    }
+    type = (index_type)header[2];
+    n_dims = header[3];
+    M = header[4];
+    ef_construction = header[5];
+    entry_point = ep[0];
+    max_level = ep[1];
+    if (M < 2 || entry_point >= (int32_t)n_nodes || max_level > 64)
+    {
+      return false;
+    }
+    // an entry point exactly when the graph has nodes, with at least one level
+    bool has_entry = type == HNSW && n_nodes > 0;
+    if (has_entry ? (entry_point < 0 || max_level < 0) : (entry_point != -1 || max_level != -1))
+    {
+      return false;
+    }
+    ids.resize(n_nodes);
+    deleted.resize(n_nodes);
+    data.resize((size_t)n_nodes * n_dims);
+    if (fread(ids.data(), sizeof(int64_t), n_nodes, f) != n_nodes || fread(deleted.data(), sizeof(uint8_t), n_nodes, f) != n_nodes || fread(data.data(), sizeof(float), data.size(), f) != data.size())
+    {
+      return false;
+    }
+    links.clear();
+    if (type == HNSW)
+    {
+      links.resize(n_nodes);
+      for (auto &node_links : links)
+      {
+        uint32_t n_levels;
+        if (fread(&n_levels, sizeof(n_levels), 1, f) != 1 || n_levels == 0 || n_levels > (uint32_t)max_level + 1)
+        {
+          return false;
+        }
+        node_links.resize(n_levels);
+        for (auto &l : node_links)
+        {
+          uint32_t n;
+          if (fread(&n, sizeof(n), 1, f) != 1 || n > 2 * M)
+          {
+            return false;
+          }
+          l.resize(n);
+          if (fread(l.data(), sizeof(uint32_t), n, f) != n)
+          {
+            return false;
+          }
+          for (auto nb : l)
+          {
+            if (nb >= n_nodes)
+            {
+              return false;
+            }
+          }
+        }
+      }
+      // searches start from the top level of the entry point and only follow links to nodes having that level
+      if (has_entry && links[entry_point].size() != (size_t)max_level + 1)
+      {
+        return false;
+      }
+      for (auto &node_links : links)
+      {
+        for (size_t lc = 0; lc < node_links.size(); lc++)
+        {
+          for (auto nb : node_links[lc])
+          {
+            if (links[nb].size() <= lc)
+            {
+              return false;
+            }
+          }
+        }
+      }
+    }
+    id_to_node.clear();
+    n_alive = 0;
+    for (uint32_t node = 0; node < n_nodes; node++)
+    {
+      if (!deleted[node])
+      {
+        id_to_node[ids[node]] = node;
+        n_alive++;
+      }
+    }
+    return true;
+  }
+
+private:
+  // tag of visited nodes, reset by incrementing visit_epoch instead of clearing
+  mutable std::vector<uint32_t> visit_tags;
+  mutable uint32_t visit_epoch = 0;
+
+  // greedy best-first search on one level of the graph, return up to ef nodes (unordered)
+  std::vector<scored> search_layer(const float *q, uint32_t ep, size_t ef, int32_t level) const
+  {
+    visit_tags.resize(ids.size(), 0);
+    if (++visit_epoch == 0)
+    {
+      std::fill(visit_tags.begin(), visit_tags.end(), 0);
+      visit_epoch = 1;
+    }
+    std::priority_queue<scored> candidates;                                          // best first
+    std::priority_queue<scored, std::vector<scored>, std::greater<scored>> results; // worst first
+    float s = vec_dot(q, vec(ep), n_dims);
+    candidates.push({s, ep});
+    results.push({s, ep});
+    visit_tags[ep] = visit_epoch;
+    while (!candidates.empty())
+    {
+      scored c = candidates.top();
+      if (results.size() >= ef && c.first < results.top().first)
+      {
+        break;
+      }
+      candidates.pop();
+      for (uint32_t nb : links[c.second][level])
+      {
+        if (visit_tags[nb] == visit_epoch)
+        {
+          continue;
+        }
+        visit_tags[nb] = visit_epoch;
+        float s = vec_dot(q, vec(nb), n_dims);
+        if (results.size() < ef || s > results.top().first)
+        {
+          candidates.push({s, nb});
+          results.push({s, nb});
+          if (results.size() > ef)
+          {
+            results.pop();
+          }
+        }
+      }
+    }
+    std::vector<scored> output;
+    output.reserve(results.size());
+    for (; !results.empty(); results.pop())
+    {
+      output.push_back(results.top());
+    }
+    return output;
+  }
+
+  void insert_hnsw(uint32_t node)
+  {
+    // random level with exponentially decaying probability
+    double u = 1.0 - std::uniform_real_distribution<double>(0.0, 1.0)(rng);
+    int32_t level = std::min((int32_t)std::floor(-std::log(u) / std::log((double)M)), 16);
+    links.emplace_back(level + 1);
+    if (entry_point < 0)
+    {
+      entry_point = node;
+      max_level = level;
+      return;
+    }
+    const float *q = vec(node);
+    uint32_t ep = entry_point;
+    for (int32_t lc = max_level; lc > level; lc--)
+    {
+      auto best = search_layer(q, ep, 1, lc);
+      ep = best[0].second;
+    }
+    for (int32_t lc = std::min(level, max_level); lc >= 0; lc--)
+    {
+      auto neighbors = search_layer(q, ep, ef_construction, lc);
+      std::sort(neighbors.begin(), neighbors.end(), std::greater<scored>());
+      const size_t max_links = lc == 0 ? 2 * M : M;
+      for (size_t i = 0; i < neighbors.size() && i < M; i++)
+      {
+        uint32_t nb = neighbors[i].second;
+        links[node][lc].push_back(nb);
+        links[nb][lc].push_back(node);
+        if (links[nb][lc].size() > max_links)
+        {
+          shrink_links(nb, lc, max_links);
+        }
+      }
+      ep = neighbors[0].second;
+    }
+    if (level > max_level)
+    {
+      max_level = level;
+      entry_point = node;
+    }
+  }
+
+  // only keep the closest neighbors of a node
+  void shrink_links(uint32_t node, int32_t level, size_t max_links)
+  {
+    auto &l = links[node][level];
+    std::vector<scored> scores;
+    scores.reserve(l.size());
+    for (uint32_t nb : l)
+    {
+      scores.push_back({vec_dot(vec(node), vec(nb), n_dims), nb});
+    }
+    std::partial_sort(scores.begin(), scores.begin() + max_links, scores.end(), std::greater<scored>());
+    l.resize(max_links);
+    for (size_t i = 0; i < max_links; i++)
+    {
+      l[i] = scores[i].second;
+    }
+  }
+};
@@ -72,20 +72,58 @@ extern "C" const char *wllama_action(const char *name, const char *body)
     WLLAMA_ACTION(sampling_init);
     WLLAMA_ACTION(sampling_sample);
     WLLAMA_ACTION(sampling_accept);
+    WLLAMA_ACTION(sampling_snapshot);
+    WLLAMA_ACTION(sampling_restore);
+    WLLAMA_ACTION(sampling_snapshot_free);
     WLLAMA_ACTION(get_vocab);
     WLLAMA_ACTION(lookup_token);
     WLLAMA_ACTION(tokenize);
     WLLAMA_ACTION(detokenize);
+    WLLAMA_ACTION(tokenize_stream_open);
+    WLLAMA_ACTION(tokenize_stream_feed);
+    WLLAMA_ACTION(tokenize_stream_close);
+    WLLAMA_ACTION(detokenize_stream);
     WLLAMA_ACTION(decode);
     WLLAMA_ACTION(encode);
+    WLLAMA_ACTION(encode_generate);
     WLLAMA_ACTION(get_logits);
+    WLLAMA_ACTION(beam_search);
+    WLLAMA_ACTION(generate_parallel);
     WLLAMA_ACTION(embeddings);
+    WLLAMA_ACTION(embeddings_batch);
+    WLLAMA_ACTION(embeddings_long);
+    WLLAMA_ACTION(embeddings_tokens);
+    WLLAMA_ACTION(embeddings_set_projection);
+    WLLAMA_ACTION(rerank);
+    WLLAMA_ACTION(embeddings_cache_config);
+    WLLAMA_ACTION(embeddings_cache_save);
+    WLLAMA_ACTION(embeddings_cache_load);
+    WLLAMA_ACTION(vector_index_create);
+    WLLAMA_ACTION(vector_index_add);
+    WLLAMA_ACTION(vector_index_search);
+    WLLAMA_ACTION(vector_index_remove);
+    WLLAMA_ACTION(vector_index_save);
+    WLLAMA_ACTION(vector_index_load);
+    WLLAMA_ACTION(vector_index_free);
     WLLAMA_ACTION(chat_format);
     WLLAMA_ACTION(kv_remove);
     WLLAMA_ACTION(kv_clear);
     WLLAMA_ACTION(current_status);
     WLLAMA_ACTION(session_save);
     WLLAMA_ACTION(session_load);
+    WLLAMA_ACTION(session_load_begin);
+    WLLAMA_ACTION(session_load_feed);
+    WLLAMA_ACTION(session_export);
+    WLLAMA_ACTION(alloc_in_buf);
+    WLLAMA_ACTION(kv_snapshot_save);
+    WLLAMA_ACTION(kv_snapshot_load);
+    WLLAMA_ACTION(kv_snapshot_delete);
+    WLLAMA_ACTION(kv_snapshot_config);
+    WLLAMA_ACTION(kv_snapshot_export);
+    WLLAMA_ACTION(kv_snapshot_import);
+    WLLAMA_ACTION(kv_checkpoint_save);
+    WLLAMA_ACTION(kv_checkpoint_load);
+    WLLAMA_ACTION(kv_checkpoint_delete);
     result = std::string(res.dump());
     return result.c_str();
   }